@@ -0,0 +1,66 @@
+"""
+PlatformIO pre-build script. When the build defines EMBED_CERTS, the DER files
+used by loadCertMQTT() are converted to byte arrays in certs.h so they are
+linked into flash and imported without mounting SPIFFS.
+
+The header is generated in the build directory and is never committed.
+Can also be run by hand: python scripts/embed_certs.py <output dir>
+"""
+
+import os
+import sys
+
+# Array name -> file in data/
+CERTS = [
+    ("CA_DER", "MS.der"),
+    ("CERT_DER", "nb1_cert.der"),
+    ("KEY_DER", "nb1_key.der"),
+]
+
+
+def generate(data_dir, out_dir):
+    os.makedirs(out_dir, exist_ok=True)
+    lines = [
+        "// Generated by scripts/embed_certs.py from the files in data/ - do not edit",
+        "#ifndef CERTS_H",
+        "#define CERTS_H",
+        "",
+        "#include <stdint.h>",
+        "",
+    ]
+    for name, filename in CERTS:
+        with open(os.path.join(data_dir, filename), "rb") as f:
+            blob = f.read()
+        lines.append("// %s, %d bytes" % (filename, len(blob)))
+        lines.append("constexpr uint8_t %s[] = {" % name)
+        for i in range(0, len(blob), 16):
+            lines.append("  " + ", ".join("0x%02x" % b for b in blob[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+    lines.append("#endif // CERTS_H")
+    lines.append("")
+
+    path = os.path.join(out_dir, "certs.h")
+    text = "\n".join(lines)
+    # Only touch the file if the contents changed, to avoid needless rebuilds
+    if os.path.exists(path):
+        with open(path) as f:
+            if f.read() == text:
+                return path
+    with open(path, "w") as f:
+        f.write(text)
+    return path
+
+
+if __name__ == "__main__":
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    print(generate(os.path.join(root, "data"), sys.argv[1] if len(sys.argv) > 1 else "."))
+else:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+
+    defines = env.ParseFlags(env["BUILD_FLAGS"]).get("CPPDEFINES", [])  # noqa: F821
+    names = [d if isinstance(d, str) else d[0] for d in defines]
+    if "EMBED_CERTS" in names:
+        out_dir = os.path.join(env.subst("$BUILD_DIR"), "generated")  # noqa: F821
+        generate(env.subst("$PROJECT_DATA_DIR"), out_dir)  # noqa: F821
+        env.Append(CPPPATH=[out_dir])  # noqa: F821
@@ -24,7 +24,10 @@ const char SARA_SEND_MQTT[] = "+UMQTTC=2";
 const char SARA_SEND_OK[] = "+UMQTTC: 2,1";
 
 const char SARA_LOGIN[] = "AT+UMQTTC=1";
-const char SARA_LOGIN_OK[] = "+UUMQTTC: 1,0";
+const char SARA_LOGIN_RESULT[] = "+UUMQTTC: 1,"; // Followed by the result, 0 if the broker accepted the login
+
+const char SARA_LOGOUT[] = "AT+UMQTTC=0";
+const char SARA_LOGOUT_OK[] = "+UMQTTC: 0,1";
 
 const char SARA_WILL_TOPIC_MQTT[] = "+UMQTTWTOPIC=";
 const char SARA_TOPIC_OK[] = "+UMQTTWTOPIC: 1";
@@ -43,14 +46,34 @@ const char SARA_SET_APN[] = "+CGDCONT=1,\"IP\",";
 
 const char SARA_NETWORK_INFO_GET[] = "+CGDCONT?";
 
+const char SARA_SIGNAL_QUALITY[] = "+CSQ";
+const char SARA_EXT_SIGNAL_QUALITY[] = "+CESQ";
+
+const char SARA_CLOCK_GET[] = "+CCLK?";
+
 const char SARA_MQTT_SECURE[] = "+UMQTT=11,1,"; // 11 is the secure command
 const char SARA_MQTT_SECURE_SET_RESPONSE[] = "+UMQTT: 11,1";
 
 const char SARA_SECURITY_PROFILE[] = "+USECPRF=";
+const int SARA_SESSION_RESUMPTION = 13; // +USECPRF op code for TLS session resumption
+
+const char SARA_SOCKET_CREATE[] = "+USOCR=6"; // 6 is TCP
+const char SARA_SOCKET_CREATE_OK[] = "+USOCR";
+const char SARA_SOCKET_SECURE[] = "+USOSEC=";
+const char SARA_SOCKET_CONNECT[] = "+USOCO=";
+const char SARA_SOCKET_WRITE[] = "+USOWR=";
+const char SARA_SOCKET_WRITE_READY[] = "@";
+const char SARA_SOCKET_WRITE_OK[] = "+USOWR: ";
+const char SARA_SOCKET_READ[] = "+USORD=";
+const char SARA_SOCKET_READ_OK[] = "+USORD: ";
+const char SARA_SOCKET_CLOSE[] = "+USOCL=";
 
 const char SARA_MQTT_ID[] = "+UMQTT=0,"; // 0 is the identity command
 const char SARA_MQTT_ID_SET_RESPONSE[] = "+UMQTT: 0,1";
 
+const char SARA_MQTT_AUTH[] = "+UMQTT=4,"; // 4 is the username and password command
+const char SARA_MQTT_AUTH_SET_RESPONSE[] = "+UMQTT: 4,1";
+
 
 
 #endif //AT_COMMANDS_H
\ No newline at end of file
@@ -0,0 +1,466 @@
+/**
+ * @file AT_parser.h
+ * @author Bergma
+ * @brief Zero-copy parser for information text responses from the U-Blox R410M-02B
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Responses of the form +CMD: a,"b",c are tokenized in place. Each field is a view
+ * @details (pointer + length) into the receive buffer, so no data is copied or allocated.
+ * @details Typed accessors convert fields to int, hex or string on demand, and the query
+ * @details helpers fill small structs for the commands the driver cares about.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef AT_PARSER_H
+#define AT_PARSER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define AT_MAX_FIELDS 12
+
+/**
+ * @brief A single field of a response line. Points into the receive buffer and is not terminated.
+ */
+typedef struct
+{
+  const char *ptr;
+  uint16_t len;
+  uint8_t quoted;
+} at_field_t;
+
+/**
+ * @brief A tokenized response line, e.g. +CEREG: 0,1
+ */
+typedef struct
+{
+  const char *name; // Points at the '+' of the command name
+  uint16_t nameLen;
+  uint8_t count; // Number of fields
+  at_field_t field[AT_MAX_FIELDS];
+} at_line_t;
+
+/**
+ * @brief Tokenizes one response line in place
+ * @param line Start of the line
+ * @param len Number of characters available, the line ends at the first CR/LF or at len
+ * @param out Tokenized line
+ * @return 0 if successful, 1 if the line is not an information text response
+ */
+inline int parseATLine(const char *line, int len, at_line_t *out)
+{
+  const char *p = line;
+  const char *end = line + len;
+
+  // Skip leading whitespace and line terminators
+  while (p < end && (*p == ' ' || *p == '\r' || *p == '\n'))
+  {
+    p++;
+  }
+  if (p >= end || *p != '+')
+  {
+    return 1;
+  }
+  out->name = p;
+  while (p < end && *p != ':' && *p != '\r' && *p != '\n')
+  {
+    p++;
+  }
+  if (p >= end || *p != ':')
+  {
+    return 1;
+  }
+  out->nameLen = p - out->name;
+  out->count = 0;
+  p++;
+
+  while (p < end && *p == ' ')
+  {
+    p++;
+  }
+  // Empty parameter list
+  if (p >= end || *p == '\r' || *p == '\n')
+  {
+    return 0;
+  }
+
+  while (out->count < AT_MAX_FIELDS)
+  {
+    at_field_t *f = &out->field[out->count++];
+    if (p < end && *p == '"')
+    {
+      p++;
+      f->ptr = p;
+      f->quoted = 1;
+      while (p < end && *p != '"' && *p != '\r' && *p != '\n')
+      {
+        p++;
+      }
+      f->len = p - f->ptr;
+      if (p < end && *p == '"')
+      {
+        p++;
+      }
+    }
+    else
+    {
+      f->ptr = p;
+      f->quoted = 0;
+      while (p < end && *p != ',' && *p != '\r' && *p != '\n')
+      {
+        p++;
+      }
+      f->len = p - f->ptr;
+    }
+    if (p >= end || *p != ',')
+    {
+      break;
+    }
+    p++;
+  }
+  return 0;
+}
+
+/**
+ * @brief Finds the first line starting with prefix in a receive buffer and tokenizes it
+ * @param buf Receive buffer
+ * @param len Number of characters in the buffer
+ * @param prefix Command name including '+', e.g. "+CEREG"
+ * @param out Tokenized line
+ * @return Pointer just past the matched line (for finding the next one), NULL if not found
+ */
+inline const char *findATLine(const char *buf, int len, const char *prefix, at_line_t *out)
+{
+  const char *end = buf + len;
+  const char *p = buf;
+  int prefixLen = strlen(prefix);
+
+  while (p < end)
+  {
+    const char *eol = p;
+    while (eol < end && *eol != '\r' && *eol != '\n')
+    {
+      eol++;
+    }
+    if (eol - p > prefixLen && memcmp(p, prefix, prefixLen) == 0 && p[prefixLen] == ':')
+    {
+      if (parseATLine(p, eol - p, out) == 0)
+      {
+        return eol;
+      }
+    }
+    p = eol;
+    while (p < end && (*p == '\r' || *p == '\n'))
+    {
+      p++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Converts a field to a signed decimal integer
+ * @param line Tokenized line
+ * @param idx Field index
+ * @param out Converted value
+ * @return 0 if successful, 1 if the field is missing, empty or not a number
+ */
+inline int atFieldInt(const at_line_t *line, int idx, int *out)
+{
+  if (idx >= line->count)
+  {
+    return 1;
+  }
+  const at_field_t *f = &line->field[idx];
+  int i = 0;
+  int sign = 1;
+  int value = 0;
+  if (f->len > 0 && (f->ptr[0] == '-' || f->ptr[0] == '+'))
+  {
+    sign = f->ptr[0] == '-' ? -1 : 1;
+    i++;
+  }
+  if (i >= f->len)
+  {
+    return 1;
+  }
+  for (; i < f->len; i++)
+  {
+    if (f->ptr[i] < '0' || f->ptr[i] > '9')
+    {
+      return 1;
+    }
+    value = value * 10 + (f->ptr[i] - '0');
+  }
+  *out = sign * value;
+  return 0;
+}
+
+/**
+ * @brief Converts a field holding a hexadecimal string (e.g. "1A2B") to an integer
+ * @param line Tokenized line
+ * @param idx Field index
+ * @param out Converted value
+ * @return 0 if successful, 1 if the field is missing, empty or not hexadecimal
+ */
+inline int atFieldHex(const at_line_t *line, int idx, uint32_t *out)
+{
+  if (idx >= line->count || line->field[idx].len == 0)
+  {
+    return 1;
+  }
+  const at_field_t *f = &line->field[idx];
+  uint32_t value = 0;
+  for (int i = 0; i < f->len; i++)
+  {
+    char c = f->ptr[i];
+    if (c >= '0' && c <= '9')
+    {
+      value = (value << 4) | (c - '0');
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+      value = (value << 4) | (c - 'A' + 10);
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      value = (value << 4) | (c - 'a' + 10);
+    }
+    else
+    {
+      return 1;
+    }
+  }
+  *out = value;
+  return 0;
+}
+
+/**
+ * @brief Copies a field into a caller supplied, terminated string. Only needed when the
+ * @brief value must outlive the receive buffer.
+ * @param line Tokenized line
+ * @param idx Field index
+ * @param dest Destination buffer
+ * @param size Size of the destination buffer
+ * @return 0 if successful, 1 if the field is missing or does not fit
+ */
+inline int atFieldCopy(const at_line_t *line, int idx, char *dest, int size)
+{
+  if (idx >= line->count || line->field[idx].len >= size)
+  {
+    return 1;
+  }
+  memcpy(dest, line->field[idx].ptr, line->field[idx].len);
+  dest[line->field[idx].len] = '\0';
+  return 0;
+}
+
+/**
+ * @brief PDP context as reported by AT+CGDCONT?
+ */
+typedef struct
+{
+  int cid;
+  at_field_t pdpType;
+  at_field_t apn;
+  at_field_t address;
+} at_cgdcont_t;
+
+/**
+ * @brief Network registration status as reported by AT+CEREG?
+ * @details tac, ci and act are only valid if the module was set to report them (AT+CEREG=2)
+ */
+typedef struct
+{
+  int n;
+  int stat;
+  uint32_t tac;
+  uint32_t ci;
+  int act;
+} at_cereg_t;
+
+/**
+ * @brief Signal quality as reported by AT+CSQ
+ */
+typedef struct
+{
+  int rssi; // 0-31, 99 = not known
+  int ber;  // 0-7, 99 = not known
+} at_csq_t;
+
+/**
+ * @brief Extended signal quality as reported by AT+CESQ
+ */
+typedef struct
+{
+  int rxlev;
+  int ber;
+  int rscp;
+  int ecno;
+  int rsrq; // 0-34, 255 = not known
+  int rsrp; // 0-97, 255 = not known
+} at_cesq_t;
+
+/**
+ * @brief Network clock as reported by AT+CCLK?
+ */
+typedef struct
+{
+  int year; // Two digit year, 22 = 2022
+  int month;
+  int day;
+  int hour;
+  int minute;
+  int second;
+  int tz; // Offset from UTC in quarters of an hour
+} at_cclk_t;
+
+/**
+ * @brief Parses the first +CGDCONT line of a response
+ * @return 0 if successful, 1 if not found or malformed
+ */
+inline int parseCGDCONT(const char *buf, int len, at_cgdcont_t *out)
+{
+  at_line_t line;
+  if (findATLine(buf, len, "+CGDCONT", &line) == NULL || line.count < 4)
+  {
+    return 1;
+  }
+  if (atFieldInt(&line, 0, &out->cid))
+  {
+    return 1;
+  }
+  out->pdpType = line.field[1];
+  out->apn = line.field[2];
+  out->address = line.field[3];
+  return 0;
+}
+
+/**
+ * @brief Parses a +CEREG line, both the read response (+CEREG: n,stat,...) and the URC (+CEREG: stat,...)
+ * @return 0 if successful, 1 if not found or malformed
+ */
+inline int parseCEREG(const char *buf, int len, at_cereg_t *out)
+{
+  at_line_t line;
+  if (findATLine(buf, len, "+CEREG", &line) == NULL || line.count < 1)
+  {
+    return 1;
+  }
+  int idx = 0;
+  out->n = -1;
+  // The read response starts with <n>, the unsolicited one does not. <tac> is always quoted.
+  if (line.count >= 2 && !line.field[1].quoted)
+  {
+    if (atFieldInt(&line, 0, &out->n))
+    {
+      return 1;
+    }
+    idx = 1;
+  }
+  if (atFieldInt(&line, idx, &out->stat))
+  {
+    return 1;
+  }
+  out->tac = 0;
+  out->ci = 0;
+  out->act = -1;
+  atFieldHex(&line, idx + 1, &out->tac);
+  atFieldHex(&line, idx + 2, &out->ci);
+  atFieldInt(&line, idx + 3, &out->act);
+  return 0;
+}
+
+/**
+ * @brief Parses a +CSQ line
+ * @return 0 if successful, 1 if not found or malformed
+ */
+inline int parseCSQ(const char *buf, int len, at_csq_t *out)
+{
+  at_line_t line;
+  if (findATLine(buf, len, "+CSQ", &line) == NULL)
+  {
+    return 1;
+  }
+  if (atFieldInt(&line, 0, &out->rssi) || atFieldInt(&line, 1, &out->ber))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Parses a +CESQ line
+ * @return 0 if successful, 1 if not found or malformed
+ */
+inline int parseCESQ(const char *buf, int len, at_cesq_t *out)
+{
+  at_line_t line;
+  if (findATLine(buf, len, "+CESQ", &line) == NULL)
+  {
+    return 1;
+  }
+  if (atFieldInt(&line, 0, &out->rxlev) || atFieldInt(&line, 1, &out->ber) ||
+      atFieldInt(&line, 2, &out->rscp) || atFieldInt(&line, 3, &out->ecno) ||
+      atFieldInt(&line, 4, &out->rsrq) || atFieldInt(&line, 5, &out->rsrp))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Reads a fixed width decimal number from a string
+ * @return 0 if successful, 1 if a character is not a digit
+ */
+inline int atParseDigits(const char *p, int width, int *out)
+{
+  int value = 0;
+  for (int i = 0; i < width; i++)
+  {
+    if (p[i] < '0' || p[i] > '9')
+    {
+      return 1;
+    }
+    value = value * 10 + (p[i] - '0');
+  }
+  *out = value;
+  return 0;
+}
+
+/**
+ * @brief Parses a +CCLK line of the form +CCLK: "yy/MM/dd,hh:mm:ss+zz"
+ * @return 0 if successful, 1 if not found or malformed
+ */
+inline int parseCCLK(const char *buf, int len, at_cclk_t *out)
+{
+  at_line_t line;
+  if (findATLine(buf, len, "+CCLK", &line) == NULL || line.count < 1)
+  {
+    return 1;
+  }
+  // The time string contains a comma, so it is only a single field if it was quoted
+  const at_field_t *f = &line.field[0];
+  if (!f->quoted || f->len < 20)
+  {
+    return 1;
+  }
+  const char *p = f->ptr;
+  if (atParseDigits(p, 2, &out->year) || atParseDigits(p + 3, 2, &out->month) ||
+      atParseDigits(p + 6, 2, &out->day) || atParseDigits(p + 9, 2, &out->hour) ||
+      atParseDigits(p + 12, 2, &out->minute) || atParseDigits(p + 15, 2, &out->second) ||
+      atParseDigits(p + 18, 2, &out->tz))
+  {
+    return 1;
+  }
+  if (p[17] == '-')
+  {
+    out->tz = -out->tz;
+  }
+  return 0;
+}
+
+#endif // AT_PARSER_H
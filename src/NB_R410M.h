@@ -7,826 +7,1518 @@
  * @details Use this library to initialize the module, setup the APN, connect to the network, and communicate via MQTT.
  * @details The function printToConsole() must be populated with the device specific implementation of Serial Print.
  * @details This library is based on the u-blox SARA-R4 AT Commands Manual (UBX-17003787 - R09)
+ * @details The driver is the class template NB_R410M, parameterized on its transport. A transport needs
+ * @details begin(baud), available(), read(), print(const char *) and write(const uint8_t *, size_t), which
+ * @details HardwareSerial provides. Each instance holds its own buffers, state and metrics, so several
+ * @details modems can be driven at once. src/main.cpp defines printToConsole() and the instance lteModem,
+ * @details which drives the module on lteSerial. Built with MQTT_SOCKET, lteModem runs MQTT on the ESP32
+ * @details over a module socket, see NB_mqtt_socket.h. The helpers (NB_scheduler.h, NB_resume.h, ...) take
+ * @details the modem as a parameter, the program defines their state.
+ * @details Built without ARDUINO, the host program provides millis(), delay() and printToConsole(), see NB_host.h.
  * @details Steps to use this library:
  * @details   1 Call initModule() to initialize the module and enable AT interface and Timezone update
  * @details   2 Call setAPN() to set the operator APN
  * @details   3 Call getNetwork() to get status of network aquisition
+ * @details        With the GPIO16 status pin wired, netStatusWait() from NB_netstatus.h waits without polling
  * @details   4 Call printInfo() to print connection information (TODO)
- * @details   5 Call loadCertMQTT() to loads certificates from filesystem and upload to module (If using SSL/TLS). 
- *                    This function is called 3 times, once for each certificate (CA, CERT, KEY)
- * @details   6 Call assignCert() to assign the certificates to a security profile (If using SSL/TLS)
- * @details   7 Call enableSSL() to enable SSL/TLS
- * @details   8 Call setMQTTid() to set the MQTT ID
+ * @details   5 Call loadCertMQTT() to loads certificates from filesystem and upload to module (If using SSL/TLS).
+ * @details        This function is called 3 times, once for each certificate (CA, CERT, KEY)
+ * @details        When built with EMBED_CERTS, call importCertMQTT() with the arrays from certs.h instead
+ * @details   6 Call resetSecurityProfile() and assignCert() to assign the certificates to a clean security profile
+ * @details        (If using SSL/TLS)
+ * @details   7 Call enableSSL() to enable SSL/TLS, and enableSessionResumption() to make reconnects cheaper
+ * @details   8 Call setMQTTid() to set the MQTT ID, and setMQTTauth() if the broker takes a username and password
  * @details   9 Call setMQTT() to set broker hostname and port
  * @details   10 Call willconfigMQTT() to set Last Will topic
  * @details   11 Call willmsgMQTT() to set Last Will message
  * @details   12 Call setMQTTping() to set MQTT keepalive interval
  * @details   13 Call enableMQTTkeepalive() to enable MQTT keepalive
+ * @details        Steps 6 to 13 can be wrapped in beginBatch() and endBatch() to send them as a few command lines
+ * @details        configureConnection() from NB_connect.h runs steps 6 to 13 this way from one set of settings
  * @details   14 Call loginMQTT() to login to MQTT broker
  * @details   15 Call publishMessage() to publish message to MQTT broker
  */
 
+#ifndef NB_R410M_H
+#define NB_R410M_H
+
+#ifdef ARDUINO
 #include <Arduino.h>
-#include "AT_commands.h"
 #include <HardwareSerial.h>
 #include "SPIFFS.h"
-
-HardwareSerial lteSerial(2);
-
-#define SerialMonitor Serial
-#define LTEShieldSerial lteSerial
+#else
+#include "NB_host.h"
+#endif
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AT_commands.h"
+#include "AT_parser.h"
+
+#ifndef AT_RESPONSE_SIZE
+#define AT_RESPONSE_SIZE 256 // Receive buffer for responses that are parsed
+#endif
+#ifndef AT_COMMAND_SIZE
+#define AT_COMMAND_SIZE 384 // Transmit buffer, limits topic + message length in publishMessage()
+#endif
+#ifndef AT_BATCH_MAX
+#define AT_BATCH_MAX 8 // Most commands combined into one concatenated command line
+#endif
+#ifndef CERT_CHUNK_SIZE
+#define CERT_CHUNK_SIZE 128 // Stack buffer for streaming a certificate file in loadCertMQTT()
+#endif
+#ifndef SOCKET_WRITE_MAX
+#define SOCKET_WRITE_MAX 1024 // Largest +USOWR write in binary mode
+#endif
+#ifndef TLS_RESUMED_PERCENT
+#define TLS_RESUMED_PERCENT 70 // A login faster than this share of a full handshake resumed the session
+#endif
 
 /**
  * @brief Use this function for your own port of UART print to console
  * @param text Text to print
  */
-void printToConsole(const char *text)
+void printToConsole(const char *text);
+
+/**
+ * @brief Signal quality in dBm and the estimated NB-IoT coverage class
+ */
+typedef struct
 {
-  SerialMonitor.print(text);
-}
+  int rsrp;     // Reference signal received power in dBm, 0 if not known
+  int rsrq;     // Reference signal received quality in dB, 0 if not known
+  int rssi;     // Received signal strength in dBm, 0 if not known
+  int coverage; // Estimated coverage enhancement level 0-2, -1 if not known
+} signal_quality_t;
 
 /**
- * @brief Empties the serial buffer and transmits the command
- * @param command The string command to be transmitted
+ * @brief Counters kept per modem instance
  */
-void transmitCommand(const char *command)
+typedef struct
 {
-  // printToConsole("Command: %s\n", command);
-  //  Empty the serial buffer
-  while (LTEShieldSerial.available())
-  {
-    LTEShieldSerial.read();
-  }
-  // Transmit the command
-  LTEShieldSerial.print(command);
-  LTEShieldSerial.print("\r");
-}
+  unsigned long commands;   // Commands transmitted
+  unsigned long timeouts;   // Responses that did not arrive or were not as expected
+  unsigned long bytesTx;    // Bytes written to the transport
+  unsigned long bytesRx;    // Bytes read from the transport
+  unsigned long responseMs; // Total time spent waiting for responses
+} modem_metrics_t;
 
 /**
- * @brief gets response from the LTE shield and compares it to the expected response
- * @param response Expected response
- * @param timeout Timeout in milliseconds
- * @return 1 if response is as expected, 0 if not
+ * @brief A command queued in a batch, see beginBatch()
  */
-int getResponse(const char *response, int timeout)
+typedef struct
 {
-  unsigned long timeIn = millis();
-  char ret[128];
-  int destIndex = 0;
-  int index = 0;
-  char c;
-  int size = strlen(response);
+  int start;            // Offset of the command without "AT" in the batch line
+  int len;
+  const char *expected; // Response that confirms the command, "OK" if only the final result code does
+  int timeout;
+  int confirmed;
+} at_batch_cmd_t;
 
-  while (millis() - timeIn < timeout)
+/**
+ * @brief TLS handshake statistics of the MQTT logins
+ */
+typedef struct
+{
+  unsigned long full;      // Logins with a full handshake
+  unsigned long fullMs;    // Total login time of those
+  unsigned long offered;   // Logins where the module held a session to resume
+  unsigned long resumed;   // Of those, logins where the session was resumed
+  unsigned long resumedMs; // Total login time of the resumed logins
+  unsigned long lastMs;    // Login time of the last successful login
+} tls_stats_t;
+
+template <class Transport>
+class NB_R410M
+{
+public:
+  Transport &serial;
+  modem_metrics_t metrics;
+  int registration; // Last +CEREG status, 4 (unknown) until getNetwork() has run
+  char ip[16];      // Last IP address from printInfo()
+  tls_stats_t tls;
+  int tlsResumption; // 1 if session resumption is enabled on the MQTT security profile
+  int tlsSession;    // 1 if the module holds the TLS session of the last login
+
+  NB_R410M(Transport &transport)
+      : serial(transport), registration(4), tlsResumption(0), tlsSession(0), batching(0), batchCount(0),
+        batchLen(0), batchFailed(0), batchTotal(0)
   {
-    if (LTEShieldSerial.available())
+    memset(&metrics, 0, sizeof(metrics));
+    memset(&tls, 0, sizeof(tls));
+    ip[0] = '\0';
+  }
+
+  /**
+   * @brief Empties the serial buffer and transmits the command
+   * @param command The string command to be transmitted
+   */
+  void transmitCommand(const char *command)
+  {
+    if (batching)
+    {
+      queueBatch(command);
+      return;
+    }
+    // printToConsole("Command: %s\n", command);
+    //  Empty the serial buffer
+    while (serial.available())
     {
-      c = (char)LTEShieldSerial.read();
-      //Serial.print(c);
-      ret[destIndex++] = c;
+      serial.read();
+      metrics.bytesRx++;
+    }
+    // Transmit the command
+    serial.print(command);
+    serial.print("\r");
+    metrics.commands++;
+    metrics.bytesTx += strlen(command) + 1;
+  }
 
-      if (c == response[index])
+  /**
+   * @brief gets response from the LTE shield and compares it to the expected response
+   * @param response Expected response
+   * @param timeout Timeout in milliseconds
+   * @return 1 if response is as expected, 0 if not
+   */
+  int getResponse(const char *response, int timeout)
+  {
+    if (batching)
+    {
+      // Confirmed when the batch is sent
+      if (batchCount > 0)
       {
-        index++;
-        if (index == size)
-        {
-          return 1;
-        }
+        batchCmds[batchCount - 1].expected = response;
+        batchCmds[batchCount - 1].timeout = timeout;
       }
-      else
+      return 1;
+    }
+    unsigned long timeIn = millis();
+    int index = 0;
+    char c;
+    int size = strlen(response);
+
+    while (millis() - timeIn < (unsigned long)timeout)
+    {
+      if (serial.available())
       {
-        index = 0;
+        c = (char)serial.read();
+        metrics.bytesRx++;
+
+        if (c == response[index])
+        {
+          index++;
+          if (index == size)
+          {
+            metrics.responseMs += millis() - timeIn;
+            return 1;
+          }
+        }
+        else
+        {
+          // The character may start a new match
+          index = c == response[0] ? 1 : 0;
+        }
       }
     }
+    metrics.timeouts++;
+    metrics.responseMs += millis() - timeIn;
+    return 0;
   }
-  ret[destIndex] = '\0';
-  //Serial.println(ret);
-  return 0;
-}
 
-/**
- * @brief Initializes the LTE Shield and enables AT interface and Timezone update
- * @param timeout Timeout in milliseconds (30000 thousand is recommended)
- * @return 0 if successful, 1 if not
- */
-int initModule(int timeout)
-{
-  LTEShieldSerial.begin(115200);
-  unsigned long startTime = millis();
-  printToConsole("Transmitting AT\n"); 
-  while (!getResponse("OK", 500))
+  /**
+   * @brief Reads a complete response from the LTE shield into buf, up to and including the final result code
+   * @param buf Receive buffer. The response is terminated so it can be printed
+   * @param size Size of the receive buffer
+   * @param timeout Timeout in milliseconds
+   * @return Number of characters read if the response ended with OK, -1 on ERROR or timeout
+   */
+  int readResponse(char *buf, int size, int timeout)
   {
-    printToConsole(".");
-    transmitCommand("AT"); // Send AT command to enable the interface
-    
-    if (millis() - startTime > timeout)
+    unsigned long timeIn = millis();
+    int index = 0;
+    int lineStart = 0;
+    char c;
+
+    while (millis() - timeIn < (unsigned long)timeout && index < size - 1)
     {
-      printToConsole("No response from module\n");
-      return 1;
+      if (serial.available())
+      {
+        c = (char)serial.read();
+        metrics.bytesRx++;
+        buf[index++] = c;
+        if (c != '\n')
+        {
+          continue;
+        }
+        // A line has been completed, check if it is a final result code
+        const char *line = buf + lineStart;
+        int len = index - lineStart;
+        lineStart = index;
+        if (len >= 4 && memcmp(line, "OK\r\n", 4) == 0)
+        {
+          buf[index] = '\0';
+          metrics.responseMs += millis() - timeIn;
+          return index;
+        }
+        if ((len >= 5 && memcmp(line, "ERROR", 5) == 0) || (len >= 10 && memcmp(line, "+CME ERROR", 10) == 0))
+        {
+          buf[index] = '\0';
+          metrics.responseMs += millis() - timeIn;
+          return -1;
+        }
+      }
     }
+    buf[index] = '\0';
+    metrics.timeouts++;
+    metrics.responseMs += millis() - timeIn;
+    return -1;
   }
-  printToConsole("Got OK\n");
 
-  printToConsole("Disabling echo\n");
-  transmitCommand("ATE0"); // Disable echo
-  if (getResponse("OK", 200))
+  /**
+   * @brief Initializes the LTE Shield and enables AT interface and Timezone update
+   * @param timeout Timeout in milliseconds (30000 thousand is recommended)
+   * @return 0 if successful, 1 if not
+   */
+  int initModule(int timeout)
   {
-    printToConsole("Echo disabled\n");
-  }
-  else
-  {
-    printToConsole("Echo not disabled\n");
-  }
+    serial.begin(115200);
+    // A module that has to be initialized has lost its TLS session cache
+    tlsSession = 0;
+    unsigned long startTime = millis();
+    printToConsole("Transmitting AT\n");
+    while (!getResponse("OK", 500))
+    {
+      printToConsole(".");
+      transmitCommand("AT"); // Send AT command to enable the interface
 
-  transmitCommand("AT+CTZU=1"); // Enable automatic time zone update
-  if (getResponse("OK", 5000))
-  {
-    printToConsole("Automatic time zone update enabled\n");
-  }
-  else
-  {
-    printToConsole("Automatic time zone update not enabled\n");
-  }
+      if (millis() - startTime > (unsigned long)timeout)
+      {
+        printToConsole("No response from module\n");
+        return 1;
+      }
+    }
+    printToConsole("Got OK\n");
 
-  transmitCommand("AT+UGPIOC=16,2"); // Set GPIO16 to indicate network status
-  if (getResponse("OK", 5000))
-  {
-    printToConsole("GPIO16 set to indicate network status\n");
-  }
-  else
-  {
-    printToConsole("GPIO16 not set to indicate network status\n");
-  }
+    printToConsole("Disabling echo\n");
+    transmitCommand("ATE0"); // Disable echo
+    if (getResponse("OK", 200))
+    {
+      printToConsole("Echo disabled\n");
+    }
+    else
+    {
+      printToConsole("Echo not disabled\n");
+    }
 
-  return 0;
-}
-/**
- * @brief Enables SSL/TLS for mqtt connection
- * @param profile SSL profile number
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int enableSSL(int profile)
-{
-  int returnVal = 1;
-  char *command = NULL;
-  command = (char *)malloc(strlen(AT) + strlen(SARA_MQTT_SECURE) + 5);
-  if (command == NULL)
-  {
-    printToConsole("Malloc failed");
-    return 2;
-  }
+    transmitCommand("AT+CTZU=1"); // Enable automatic time zone update
+    if (getResponse("OK", 5000))
+    {
+      printToConsole("Automatic time zone update enabled\n");
+    }
+    else
+    {
+      printToConsole("Automatic time zone update not enabled\n");
+    }
 
-  sprintf(command, "%s%s%d", AT, SARA_MQTT_SECURE, profile);
-  transmitCommand(command);
-  if (getResponse(SARA_MQTT_SECURE_SET_RESPONSE, 5000))
-  {
-    printToConsole("SSL enabled\n");
-    returnVal = 0;
-  }
-  else
-  {
-    printToConsole("SSL not enabled\n");
-    returnVal = 1;
+    transmitCommand("AT+UGPIOC=16,2"); // Set GPIO16 to indicate network status
+    if (getResponse("OK", 5000))
+    {
+      printToConsole("GPIO16 set to indicate network status\n");
+    }
+    else
+    {
+      printToConsole("GPIO16 not set to indicate network status\n");
+    }
+
+    return 0;
   }
-  free(command);
-  return returnVal;
-}
 
-/**
- * @brief Assigns loaded certificates to a profile
- * @param profile SSL profile number
- * @param certName Certificate name assigned when loading certificate
- * @param certType Certificate type, 3 for CA, 4 for expected hostname, 5 for CERT, 6 for KEY
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int assignCert(int profile, const char *certName, int certType)
-{
-  int returnVal = 1;
-  char *command = NULL;
-  command = (char *)malloc(strlen(AT) + strlen(SARA_SECURITY_PROFILE) + strlen(certName) + 10);
-  if (command == NULL)
+  /**
+   * @brief Enables SSL/TLS for mqtt connection
+   * @param profile SSL profile number
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int enableSSL(int profile)
   {
-    printToConsole("Malloc failed");
-    return 2;
+    if (formatCommand("%s%s%d", AT, SARA_MQTT_SECURE, profile))
+    {
+      return 2;
+    }
+    tlsSession = 0;
+    transmitCommand(command);
+    if (getResponse(SARA_MQTT_SECURE_SET_RESPONSE, 5000))
+    {
+      printStatus("SSL enabled\n");
+      return 0;
+    }
+    printStatus("SSL not enabled\n");
+    return 1;
   }
-  sprintf(command, "%s%s%d,%d,\"%s\"", AT, SARA_SECURITY_PROFILE, profile, certType, certName);
-  transmitCommand(command);
-  if (getResponse("OK",1000))
+
+  /**
+   * @brief Resets a security profile to its defaults, so certificates and options assigned earlier
+   * @brief (e.g. a client certificate before switching to SAS tokens) do not stay on it
+   * @param profile SSL profile number
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int resetSecurityProfile(int profile)
   {
-    printToConsole("Certificate [");
-    printToConsole(certName);
-    printToConsole("] assigned\n");
-    returnVal = 0;
+    if (formatCommand("%s%s%d", AT, SARA_SECURITY_PROFILE, profile))
+    {
+      return 2;
+    }
+    transmitCommand(command);
+    if (getResponse("OK", 1000))
+    {
+      printToConsole("Security profile reset\n");
+      return 0;
+    }
+    printToConsole("Security profile not reset\n");
+    return 1;
   }
-  else
+
+  /**
+   * @brief Enables TLS session resumption on a security profile, so a new login can resume the
+   * @brief session of the previous one instead of doing a full handshake
+   * @param profile SSL profile number
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int enableSessionResumption(int profile)
   {
-    printToConsole("Certificate [");
-    printToConsole(certName);
-    printToConsole("] not assigned\n");
-    returnVal = 1;
+    if (formatCommand("%s%s%d,%d,1", AT, SARA_SECURITY_PROFILE, profile, SARA_SESSION_RESUMPTION))
+    {
+      return 2;
+    }
+    transmitCommand(command);
+    if (getResponse("OK", 1000))
+    {
+      printToConsole("TLS session resumption enabled\n");
+      tlsResumption = 1;
+      return 0;
+    }
+    printToConsole("TLS session resumption not enabled\n");
+    tlsResumption = 0;
+    return 1;
   }
-  free(command);
-  return returnVal;
-}
 
-/**
- * @brief Displays the network aquisition status
- */
-void getNetwork()
-{
-  int retval;
-  int last = 99;
-  while (retval != 1)
+  /**
+   * @brief Assigns loaded certificates to a profile
+   * @param profile SSL profile number
+   * @param certName Certificate name assigned when loading certificate
+   * @param certType Certificate type, 3 for CA, 4 for expected hostname, 5 for CERT, 6 for KEY
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int assignCert(int profile, const char *certName, int certType)
   {
-
-    // Empty the serial buffer
-    while (LTEShieldSerial.available())
+    if (formatCommand("%s%s%d,%d,\"%s\"", AT, SARA_SECURITY_PROFILE, profile, certType, certName))
     {
-      LTEShieldSerial.read();
+      return 2;
     }
-    transmitCommand("AT+CEREG?");
-    unsigned long timeIn = millis();
-    char ret[128];
-    int destIndex = 0;
-    int index = 0;
-    char c;
-    int size = 12;
-    retval = 4;
+    // The profile changes, a cached session no longer matches it
+    tlsSession = 0;
+    transmitCommand(command);
+    if (getResponse("OK", 1000))
+    {
+      printStatus("Certificate [");
+      printStatus(certName);
+      printStatus("] assigned\n");
+      return 0;
+    }
+    printStatus("Certificate [");
+    printStatus(certName);
+    printStatus("] not assigned\n");
+    return 1;
+  }
+
+  /**
+   * @brief Displays the network aquisition status. Blocks until registered on the home network
+   */
+  void getNetwork()
+  {
+    int retval = 4;
+    int last = 99;
+    at_cereg_t cereg;
 
-    while (millis() - timeIn < 1000)
+    while (retval != 1)
     {
-      if (LTEShieldSerial.available())
+      transmitCommand("AT+CEREG?");
+      retval = 4;
+      int len = readResponse(response, sizeof(response), 1000);
+      if (len > 0 && parseCEREG(response, len, &cereg) == 0)
+      {
+        retval = cereg.stat;
+      }
+      registration = retval;
+      switch (retval)
       {
-        c = (char)LTEShieldSerial.read();
-        // Serial.print(c);
-        ret[index++] = c;
-        // printToConsole("index: %d\n", index);
-        if (index > size)
+      case 0:
+        if (last != retval)
+        {
+          printToConsole("Not registered, MT is not currently searching a new operator to register to\n");
+          last = retval;
+        }
+        else
+        {
+          printToConsole(".");
+        }
+        break;
+      case 1:
+        if (last != retval)
+        {
+          printToConsole("Registered, home network\n");
+          last = retval;
+        }
+        else
+        {
+          printToConsole(".");
+        }
+        break;
+      case 2:
+        if (last != retval)
+        {
+          printToConsole("Scanning for network\n");
+          last = retval;
+        }
+        else
+        {
+          printToConsole(".");
+        }
+        break;
+      case 3:
+        if (last != retval)
+        {
+          printToConsole("Registration denied\n");
+          last = retval;
+        }
+        else
+        {
+          printToConsole(".");
+        }
+        break;
+      case 5:
+        if (last != retval)
+        {
+          printToConsole("Registered, roaming\n");
+          last = retval;
+        }
+        else
+        {
+          printToConsole(".");
+        }
+        break;
+      default:
+        if (last != retval)
+        {
+          printToConsole("Unknown\n");
+          last = retval;
+        }
+        else
         {
-          break;
+          printToConsole(".");
         }
+        break;
       }
+      delay(500);
     }
-    ret[++index] = 0;
-    // printToConsole("ret: %s\n", ret);
-    sscanf(ret, " +CEREG: 0,%d", &retval);
-    switch (retval)
+  }
+
+  /**
+   * @brief Queries the registration status once with AT+CEREG?
+   * @return The +CEREG status, 4 (unknown) if there was no valid response
+   */
+  int queryRegistration()
+  {
+    at_cereg_t cereg;
+    transmitCommand("AT+CEREG?");
+    int len = readResponse(response, sizeof(response), 1000);
+    if (len < 0 || parseCEREG(response, len, &cereg))
     {
-    case 0:
-      if (last != retval)
-      {
-        printToConsole("Not registered, MT is not currently searching a new operator to register to\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    case 1:
-      if (last != retval)
-      {
-        printToConsole("Registered, home network\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    case 2:
-      if (last != retval)
-      {
-        printToConsole("Scanning for network\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    case 3:
-      if (last != retval)
-      {
-        printToConsole("Registration denied\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    case 4:
-      if (last != retval)
-      {
-        printToConsole("Unknown\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    case 5:
-      if (last != retval)
-      {
-        printToConsole("Registered, roaming\n");
-        last = retval;
-      }
-      else
-      {
-        printToConsole(".");
-      }
-      break;
-    default:
-      if (last != retval)
+      registration = 4;
+    }
+    else
+    {
+      registration = cereg.stat;
+    }
+    return registration;
+  }
+
+  /**
+   * @brief Queries the signal quality with AT+CESQ, falls back to AT+CSQ if RSRP is not reported
+   * @param quality Measured signal quality
+   * @return 0 if successful, 1 if no measurement is available
+   */
+  int getSignalQuality(signal_quality_t *quality)
+  {
+    at_cesq_t cesq;
+    at_csq_t csq;
+    int len;
+
+    quality->rsrp = 0;
+    quality->rsrq = 0;
+    quality->rssi = 0;
+    quality->coverage = -1;
+
+    formatCommand("%s%s", AT, SARA_EXT_SIGNAL_QUALITY);
+    transmitCommand(command);
+    len = readResponse(response, sizeof(response), 1000);
+    if (len > 0 && parseCESQ(response, len, &cesq) == 0)
+    {
+      // RSRP index 0-97 maps to -140..-44 dBm, RSRQ index 0-34 maps to -19.5..-3 dB
+      if (cesq.rsrp != 255)
       {
-        printToConsole("Unknown\n");
-        last = retval;
+        quality->rsrp = cesq.rsrp - 141;
       }
-      else
+      if (cesq.rsrq != 255)
       {
-        printToConsole(".");
+        quality->rsrq = (cesq.rsrq - 40) / 2;
       }
-      break;
     }
-    delay(500);
+
+    formatCommand("%s%s", AT, SARA_SIGNAL_QUALITY);
+    transmitCommand(command);
+    len = readResponse(response, sizeof(response), 1000);
+    if (len > 0 && parseCSQ(response, len, &csq) == 0 && csq.rssi != 99)
+    {
+      quality->rssi = -113 + 2 * csq.rssi;
+    }
+
+    // The module does not report the CE level, estimate it from RSRP (or RSSI if RSRP is missing)
+    int level = quality->rsrp != 0 ? quality->rsrp : quality->rssi;
+    if (level == 0)
+    {
+      return 1;
+    }
+    if (level >= -110)
+    {
+      quality->coverage = 0;
+    }
+    else if (level >= -120)
+    {
+      quality->coverage = 1;
+    }
+    else
+    {
+      quality->coverage = 2;
+    }
+    return 0;
   }
-}
 
-/**
- * @brief Sets APN on LTE module
- * @param apn The APN to be set
- * @return 0 if successful, 1 if not
- */
-int setAPN(const char *apn)
-{
-  int result = 0;
-  char *command = NULL;
-  command = (char *)malloc(strlen(AT) + strlen(SARA_SET_APN) + strlen(apn) + 5);
-  if (command == NULL)
+  /**
+   * @brief Sets APN on LTE module
+   * @param apn The APN to be set
+   * @return 0 if successful, 1 if not
+   */
+  int setAPN(const char *apn)
   {
-    printToConsole("Malloc failed");
+    if (formatCommand("%s%s\"%s\"", AT, SARA_SET_APN, apn))
+    {
+      return 1;
+    }
+    transmitCommand(command);
+    if (getResponse("OK", 1000))
+    {
+      printToConsole("APN set\n");
+      return 0;
+    }
+    printToConsole("APN not set\n");
     return 1;
   }
 
-  sprintf(command, "%s%s\"%s\"", AT, SARA_SET_APN, apn);
-  transmitCommand(command);
-  if (getResponse("OK", 1000))
+  /**
+   * @brief Reads the IP address of the LTE module into ip
+   * @return Pointer to ip, NULL if not found or error. Valid until the next call
+   */
+  char *printInfo()
   {
-    Serial.println("APN set");
-    result = 0;
+    at_cgdcont_t context;
+
+    formatCommand("%s%s", AT, SARA_NETWORK_INFO_GET);
+    transmitCommand(command);
+
+    int len = readResponse(response, sizeof(response), 1000);
+    if (len < 0)
+    {
+      printToConsole("No PDP context information\n");
+      return NULL;
+    }
+    if (parseCGDCONT(response, len, &context) || context.address.len == 0 || context.address.len >= sizeof(ip))
+    {
+      printToConsole("No IP address assigned\n");
+      ip[0] = '\0';
+      return NULL;
+    }
+    memcpy(ip, context.address.ptr, context.address.len);
+    ip[context.address.len] = '\0';
+    return ip;
   }
-  else
+
+  /**
+   * @brief Transmit certificate data to the LTE shield
+   * @param cert Certificate data. Can be CA, client certificate or client key
+   * @param type Certificate type. 0 = CA, 1 = client certificate, 2 = client key
+   * @param name Certificate name. Can be any name, but must be unique
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int setCertMQTT(const uint8_t *cert, int size, int type, const char *name)
   {
-    Serial.println("APN not set");
+    int result = startCertImport(size, type, name);
+    if (result)
+    {
+      return result;
+    }
+    serial.write(cert, size);
+    metrics.bytesTx += size;
+    return finishCertImport(type);
   }
-  free(command);
-  return result;
-}
 
-/**
- * @brief Prints the IP address of the LTE module. The returned pointer must be freed by the caller.
- * @return char pointer to the IP address, NULL if not found or error
- */
-char *printInfo()
-{
-  char *ip = NULL;
-  char *command = NULL;
-  command = (char *)malloc(strlen(AT) + strlen(SARA_NETWORK_INFO_GET) + 5);
-  ip = (char *)malloc(16);
-  if (ip == NULL)
-  {
-    printToConsole("Malloc failed");
-    return NULL;
-  }
-  if (command == NULL)
-  {
-    printToConsole("Malloc failed");
-    return NULL;
-  }
-  sprintf(command, "%s%s", AT, SARA_NETWORK_INFO_GET);
-  transmitCommand(command);
-
-  char ret[128];
-  int destIndex = 0;
-  int index = 0;
-  char c;
-  char OK[] = "OK";
-  int size = 12;
-  unsigned long timeIn = millis();
-  while (millis() - timeIn < 1000)
-  {
-    if (LTEShieldSerial.available())
-    {
-      c = (char)LTEShieldSerial.read();
-      // Serial.print(c);
-      ret[index] = c;
-      // printToConsole("index: %d\n", index);
-      if (ret[index - 1] == OK[0] && ret[index] == OK[1])
+#ifdef ARDUINO
+  /**
+   * @brief Reads certificates from filesystem and loads into module
+   * @param filename Name of the file to read
+   * @param type Certificate type. 0 = CA, 1 = client certificate, 2 = client key
+   * @param name Certificate name. Can be any name, but must be unique
+   * @return -1 if load file fails, return value from setCertMQTT() if successful
+   */
+  int loadCertMQTT(const char *filename, int type, const char *name)
+  {
+    // Mounts on first use, does nothing if already mounted
+    if (!SPIFFS.begin(false))
+    {
+      printToConsole("Failed to mount SPIFFS\n");
+      return -1;
+    }
+    File certFile = SPIFFS.open(filename, "r");
+    if (!certFile)
+    {
+      printToConsole("Failed to open file for reading\n");
+      return -1;
+    }
+    int size = certFile.size();
+    int result = startCertImport(size, type, name);
+    if (result)
+    {
+      certFile.close();
+      return result;
+    }
+    // Streamed in chunks, so the file is never held in memory as a whole
+    uint8_t chunk[CERT_CHUNK_SIZE];
+    int sent = 0;
+    while (sent < size)
+    {
+      int n = certFile.read(chunk, size - sent < CERT_CHUNK_SIZE ? size - sent : CERT_CHUNK_SIZE);
+      if (n <= 0)
       {
         break;
       }
-      index++;
+      serial.write(chunk, n);
+      sent += n;
     }
+    certFile.close();
+    metrics.bytesTx += sent;
+    if (sent < size)
+    {
+      // The module still waits for the missing bytes and times out
+      printToConsole("Failed to read certificate file\n");
+    }
+    return finishCertImport(type);
   }
-  
-  ret[++index] = 0;
-  char * token = strtok(ret, ",\"");
-  for (int i = 0; i < 3; i++)
-  {
-    token = strtok(NULL, "\",\"");
-  }
-  
-  strcpy(ip, token);
-  free(command);
-  return ip;
-}
 
-/**
- * @brief Transmit certificate data to the LTE shield
- * @param cert Certificate data. Can be CA, client certificate or client key
- * @param type Certificate type. 0 = CA, 1 = client certificate, 2 = client key
- * @param name Certificate name. Can be any name, but must be unique
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int setCertMQTT(const byte *cert, int size, int type, const char *name)
-{
-  int result = 1;
-  char *command = NULL;
-  char *response = NULL;
-  response = (char *)malloc(strlen(SARA_IMPORT_CERT_OK) + 5);
-  if (response == NULL)
+  /**
+   * @brief Imports a certificate that is compiled into flash, falls back to the filesystem if
+   * @brief it is missing or the import fails
+   * @param cert Certificate data in flash, NULL if not embedded
+   * @param size Size of the certificate data
+   * @param filename Name of the file to read if the embedded import fails
+   * @param type Certificate type. 0 = CA, 1 = client certificate, 2 = client key
+   * @param name Certificate name. Can be any name, but must be unique
+   * @return 0 if successful, otherwise the return value from loadCertMQTT()
+   */
+  int importCertMQTT(const uint8_t *cert, int size, const char *filename, int type, const char *name)
   {
-    printToConsole("Malloc failed\n");
-    return 2;
+    if (cert != NULL && size > 0)
+    {
+      if (setCertMQTT(cert, size, type, name) == 0)
+      {
+        return 0;
+      }
+      printToConsole("Embedded certificate import failed, trying filesystem\n");
+    }
+    return loadCertMQTT(filename, type, name);
   }
-  command = (char *)malloc((strlen(AT) + strlen(SARA_IMPORT_CERT) + strlen(name) + 15));
-  if (command == NULL)
+#endif // ARDUINO
+
+  /**
+   * @brief Sets the MQTT ping interval
+   * @param timeout Timeout in seconds
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int setMQTTping(int timeout)
   {
-    printToConsole("Malloc failed\n");
-    free(response);
-    return 2;
+    if (formatCommand("%s%s%d", AT, SARA_TIMEOUT, timeout))
+    {
+      return 2;
+    }
+
+    // Empties buffer and transmits the command
+    transmitCommand(command);
+
+    // Wait for the response
+    if (getResponse(SARA_TIMEOUT_SET_RESPONSE, 10000))
+    {
+      char msgToPrint[50];
+      sprintf(msgToPrint, "MQTT ping interval set to %d seconds\n", timeout);
+      printStatus(msgToPrint);
+      return 0;
+    }
+    printStatus("Error setting MQTT ping timeout\n");
+    return 1;
   }
-  sprintf(command, "%s%s%d,\"%s\",%d", AT, SARA_IMPORT_CERT, type, name, size);
-  printToConsole("Importing certificate: ");
-  printToConsole(name);
-  printToConsole("\n");
-  // printToConsole("Command: %s\n", command);
-  //  Empties buffer and transmits the command
-  transmitCommand(command);
 
-  if (getResponse(SARA_IMPORT_CERT_READY, 10000))
+  /**
+   * @brief Sets the MQTT Unique Client ID
+   * @param id Unique client ID
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int setMQTTid(const char *id)
   {
-    printToConsole("Ready to receive certificate:\n");
-    // printToConsole("%s\n",cert);
-
-    sprintf(response, "%s%d", SARA_IMPORT_CERT_OK, type);
+    if (formatCommand("%s%s\"%s\"", AT, SARA_MQTT_ID, id))
+    {
+      return 2;
+    }
 
     // Empties buffer and transmits the command
-    //transmitCommand(cert);
-    while (LTEShieldSerial.available())
+    transmitCommand(command);
+
+    // Wait for the response
+    if (getResponse(SARA_MQTT_ID_SET_RESPONSE, 10000))
     {
-      LTEShieldSerial.read();
+      printStatus("MQTT client ID set to ");
+      printStatus(id);
+      printStatus("\n");
+      return 0;
     }
-    LTEShieldSerial.write(cert, size);
+    printStatus("Error setting MQTT client ID\n");
+    return 1;
+  }
 
-    if (getResponse(response, 10000))
+  /**
+   * @brief Sets the MQTT username and password, e.g. for SAS token authentication
+   * @param username MQTT username
+   * @param password MQTT password
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int setMQTTauth(const char *username, const char *password)
+  {
+    if (formatCommand("%s%s\"%s\",\"%s\"", AT, SARA_MQTT_AUTH, username, password))
     {
-      printToConsole("Certificate imported\n");
-      result = 0;
+      return 2;
     }
-    else
+
+    // Empties buffer and transmits the command
+    transmitCommand(command);
+
+    // Wait for the response
+    if (getResponse(SARA_MQTT_AUTH_SET_RESPONSE, 10000))
     {
-      printToConsole("Certificate import failed\n");
+      printStatus("MQTT username and password set\n");
+      return 0;
     }
+    printStatus("Error setting MQTT username and password\n");
+    return 1;
   }
-  else
+
+  /**
+   * @brief Enables MQTT keepalive
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int enableMQTTkeepalive()
   {
-    printToConsole("Failed to import certificate - not ready\n");
+    if (formatCommand("%s%s", AT, SARA_PING))
+    {
+      return 2;
+    }
+
+    // Empties buffer and transmits the command
+    transmitCommand(command);
+
+    // Wait for the response
+    if (getResponse(SARA_PING_OK, 10000))
+    {
+      printStatus("MQTT keepalive enabled\n");
+      return 0;
+    }
+    printStatus("Error enabling MQTT keepalive\n");
+    return 1;
   }
-  free(command);
-  free(response);
-  return result;
-}
 
-/**
- * @brief Reads certificates from filesystem and loads into module
- * @param filename Name of the file to read
- * @param type Certificate type. 0 = CA, 1 = client certificate, 2 = client key
- * @param name Certificate name. Can be any name, but must be unique
- * @return -1 if load file fails, return value from setCertMQTT() if successful
- */
-int loadCertMQTT(const char *filename, int type, const char *name)
-{
-  int result = 0;
-  File certFile = SPIFFS.open(filename, "r");
-  if (!certFile)
+  /**
+   * @brief Publishes a message to the MQTT broker
+   * @param topic The topic to publish to
+   * @param message The message to publish
+   * @param qos The QoS level to publish at
+   * @param retain Whether to retain the message
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int publishMessage(const char *topic, const char *message, int QoS, int retain)
   {
-    printToConsole("Failed to open file for reading\n");
-    return -1;
+    unsigned long SARA_SEND_TIMEOUT = 60000;
+
+    if (formatCommand("%s%s,%d,%d,%s,%s", AT, SARA_SEND_MQTT, QoS, retain, topic, message))
+    {
+      printToConsole("Message too long\n");
+      return 2;
+    }
+
+    // Empties buffer and transmits the command
+    transmitCommand(command);
+
+    if (getResponse(SARA_SEND_OK, SARA_SEND_TIMEOUT))
+    {
+      printToConsole("Message sent\n");
+      return 0;
+    }
+    printToConsole("Error sending message\n");
+    return 1;
   }
-  int size = certFile.size();
-  byte *cert = (byte *)malloc(size);
-  if (cert == NULL)
+
+  /**
+   * @brief Logout from the MQTT broker
+   * @return 0 if successful, 1 if not
+   */
+  int logoutMQTT()
   {
-    printToConsole("Malloc failed\n");
-    return -1;
-  }
-  certFile.read(cert, size);
-  certFile.close();
-  result = setCertMQTT(cert, size, type, name);
-  free(cert);
-  return result;
-}
+    // Empties buffer and transmits the command
+    transmitCommand(SARA_LOGOUT);
 
-/**
- * @brief Sets the MQTT ping interval
- * @param timeout Timeout in seconds
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int setMQTTping(int timeout)
-{
-  int result = 1;
-  char *command = NULL;
+    if (getResponse(SARA_LOGOUT_OK, 10000))
+    {
+      printToConsole("MQTT logout successfull\n");
+      return 0;
+    }
+    printToConsole("Error logging out of MQTT\n");
+    return 1;
+  }
 
-  command = (char *)malloc(strlen(AT) + strlen(SARA_TIMEOUT) + 5);
-  if (command == NULL)
+  /**
+   * @brief Login to the MQTT broker
+   * @details The module reports the result with +UUMQTTC: 1,<result>, also when the broker refused the
+   * @details connection or could not be reached. Only a module that does not answer takes the full timeout.
+   * @return 0 if successful, 1 if not
+   */
+  int loginMQTT()
   {
-    printToConsole("Malloc failed\n");
-    return 2;
-  }
-  sprintf(command, "%s%s%d", AT, SARA_TIMEOUT, timeout);
+    unsigned long SARA_IP_CONNECT_TIMEOUT = 60000;
+    unsigned long start = millis();
 
-  // Empties buffer and transmits the command
-  transmitCommand(command);
+    // Empties buffer and transmits the command
+    transmitCommand(SARA_LOGIN);
 
-  // Wait for the response
-  if (getResponse(SARA_TIMEOUT_SET_RESPONSE, 10000))
-  {
-    char msgToPrint[50];
-    sprintf(msgToPrint, "MQTT ping interval set to %d seconds\n", timeout);
-    printToConsole(msgToPrint);
-    result = 0;
+    int result = -1;
+    if (getResponse(SARA_LOGIN_RESULT, SARA_IP_CONNECT_TIMEOUT))
+    {
+      result = readByte(millis(), 1000);
+    }
+    if (result == '0')
+    {
+      printToConsole("MQTT login successfull\n");
+      recordHandshake(millis() - start);
+      return 0;
+    }
+    printToConsole("Error logging in to MQTT\n");
+    // The module drops the session when the handshake fails
+    tlsSession = 0;
+    return 1;
   }
-  else
+
+  /**
+   * @brief Configures MQTT Will topic
+   * @param topic The topic to publish to
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int willconfigMQTT(const char *topic)
   {
-    printToConsole("Error setting MQTT ping timeout\n");
-  }
-  free(command);
-  return result;
-}
+    unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
 
-/**
- * @brief Sets the MQTT Unique Client ID
- * @param id Unique client ID
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int setMQTTid(const char *id)
-{
-  int result = 1;
-  char *command = NULL;
+    if (formatCommand("%s%s%d,%d,\"%s\"", AT, SARA_WILL_TOPIC_MQTT, 0, 0, topic))
+    {
+      return 2;
+    }
 
-  command = (char *)malloc(strlen(AT) + strlen(SARA_MQTT_ID) + strlen(id) + 5);
-  if (command == NULL)
-  {
-    printToConsole("Malloc failed\n");
-    return 2;
-  }
-  sprintf(command, "%s%s\"%s\"", AT, SARA_MQTT_ID, id);
+    // Empties buffer and transmits the command
+    transmitCommand(command);
 
-  // Empties buffer and transmits the command
-  transmitCommand(command);
+    if (getResponse(SARA_TOPIC_OK, SARA_IP_CONNECT_TIMEOUT))
+    {
+      printStatus("Will topic set\n");
+      return 0;
+    }
+    printStatus("Will topic not set\n");
+    return 1;
+  }
 
-  // Wait for the response
-  if (getResponse(SARA_MQTT_ID_SET_RESPONSE, 10000))
+  /**
+   * @brief Configures MQTT Will message
+   * @param message The message to publish
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int willmsgMQTT(const char *message)
   {
-    char msgToPrint[50];
-    sprintf(msgToPrint, "MQTT client ID set to %s\n", id);
-    printToConsole(msgToPrint);
-    result = 0;
+    unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
+
+    if (formatCommand("%s%s\"%s\"", AT, SARA_WILL_MESSAGE_MQTT, message))
+    {
+      return 2;
+    }
+
+    // Empties buffer and transmits the command
+    transmitCommand(command);
+
+    if (getResponse(SARA_MESSAGE_OK, SARA_IP_CONNECT_TIMEOUT))
+    {
+      printStatus("Will message set\n");
+      return 0;
+    }
+    printStatus("Will message not set\n");
+    return 1;
   }
-  else
+
+  /**
+   * @brief Configures MQTT broker hostname and port
+   * @param hostname The hostname of the MQTT broker
+   * @param port The port of the MQTT broker
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int setMQTT(const char *host, int port)
   {
-    printToConsole("Error setting MQTT client ID\n");
-  }
-  free(command);
-  return result;
-}
+    unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
 
-/**
- * @brief Enables MQTT keepalive
- * @return 0 if successful, 1 if not, 2 if malloc failed
- */
-int enableMQTTkeepalive()
-{
-  int result = 1;
-  char *command = NULL;
+    // Create the command
+    if (formatCommand("AT%s=%d,\"%s\",%d", SARA_CONNECT_MQTT, 2, host, port))
+    {
+      return 2;
+    }
+    // Send the command
+    printStatus("Setting MQTT hostname & port\n");
 
-  command = (char *)malloc(strlen(AT) + strlen(SARA_PING) + 5);
-  if (command == NULL)
-  {
-    printToConsole("Malloc failed\n");
-    return 2;
-  }
-  sprintf(command, "%s%s", AT, SARA_PING);
+    // Empties buffer and transmits the command
+    transmitCommand(command);
 
-  // Empties buffer and transmits the command
-  transmitCommand(command);
+    // Wait for the response
+    if (getResponse(SARA_RESPONSE_OK, SARA_IP_CONNECT_TIMEOUT))
+    {
+      printStatus("MQTT hostname & port set\n");
+      return 0;
+    }
+    printStatus("MQTT hostname & port not set\n");
+    return 1;
+  }
 
-  // Wait for the response
-  if (getResponse(SARA_PING_OK, 10000))
+  /**
+   * @brief Keeps the MQTT connection alive. The module's MQTT client pings the broker by itself
+   * @return 0
+   */
+  int pollMQTT()
   {
-    printToConsole("MQTT keepalive enabled\n");
-    result = 0;
+    return 0;
   }
-  else
+
+  /**
+   * @brief Creates a TCP socket
+   * @return Socket number, -1 if no socket could be created
+   */
+  int socketOpen()
   {
-    printToConsole("Error enabling MQTT keepalive\n");
+    at_line_t line;
+    int socket;
+    formatCommand("%s%s", AT, SARA_SOCKET_CREATE);
+    transmitCommand(command);
+    int len = readResponse(response, sizeof(response), 5000);
+    if (len < 0 || findATLine(response, len, SARA_SOCKET_CREATE_OK, &line) == NULL || atFieldInt(&line, 0, &socket))
+    {
+      printToConsole("Socket not created\n");
+      return -1;
+    }
+    return socket;
   }
-  free(command);
-  return result;
-}
-
-/**
- * @brief Publishes a message to the MQTT broker
- * @param topic The topic to publish to
- * @param message The message to publish
- * @param qos The QoS level to publish at
- * @param retain Whether to retain the message
- * @return 0 if successful, 1 if not, 2 if memory allocation failed
- */
-int publishMessage(const char *topic, const char *message, int QoS, int retain)
-{
-  int result = 1;
-  char *command = NULL;
 
-  unsigned long SARA_SEND_TIMEOUT = 60000;
-
-  // printToConsole("Allocating memory for command\n");
-  command = (char *)malloc(strlen(AT) + strlen(SARA_SEND_MQTT) + strlen(message) + strlen(topic) + 8);
-  if (command == NULL)
+  /**
+   * @brief Enables TLS on a socket before it is connected
+   * @param socket Socket number from socketOpen()
+   * @param profile SSL profile number
+   * @return 0 if successful, 1 if not
+   */
+  int socketSecure(int socket, int profile)
   {
-    printToConsole("Memory allocation failed\n");
-    return 2;
+    formatCommand("%s%s%d,1,%d", AT, SARA_SOCKET_SECURE, socket, profile);
+    transmitCommand(command);
+    if (getResponse("OK", 1000))
+    {
+      return 0;
+    }
+    printToConsole("Socket TLS not enabled\n");
+    return 1;
   }
-  // printToConsole("Building command\n");
-  sprintf(command, "%s%s,%d,%d,%s,%s", AT, SARA_SEND_MQTT, QoS, retain, topic, message);
-
-  // printToConsole("Command built....Sending\n");
-
-  // Empties buffer and transmits the command
-  transmitCommand(command);
 
-  // printToConsole("Command sent....Waiting for response\n");
-  if (getResponse(SARA_SEND_OK, SARA_SEND_TIMEOUT))
+  /**
+   * @brief Connects a socket, including the TLS handshake if enabled
+   * @param socket Socket number from socketOpen()
+   * @param host Remote hostname or IP address
+   * @param port Remote port
+   * @return 0 if successful, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int socketConnect(int socket, const char *host, int port)
   {
-    printToConsole("Message sent\n");
-    result = 0;
+    unsigned long SARA_IP_CONNECT_TIMEOUT = 60000;
+    if (formatCommand("%s%s%d,\"%s\",%d", AT, SARA_SOCKET_CONNECT, socket, host, port))
+    {
+      return 2;
+    }
+    transmitCommand(command);
+    if (readResponse(response, sizeof(response), SARA_IP_CONNECT_TIMEOUT) >= 0)
+    {
+      return 0;
+    }
+    printToConsole("Socket not connected\n");
+    return 1;
   }
-  else
+
+  /**
+   * @brief Writes binary data to a connected socket
+   * @param socket Socket number from socketOpen()
+   * @param data Data to write
+   * @param size Number of bytes
+   * @return 0 if successful, 1 if not
+   */
+  int socketWrite(int socket, const uint8_t *data, int size)
   {
-    printToConsole("Error sending message\n");
+    char expected[24];
+    while (size > 0)
+    {
+      int chunk = size < SOCKET_WRITE_MAX ? size : SOCKET_WRITE_MAX;
+      formatCommand("%s%s%d,%d", AT, SARA_SOCKET_WRITE, socket, chunk);
+      transmitCommand(command);
+      if (!getResponse(SARA_SOCKET_WRITE_READY, 5000))
+      {
+        printToConsole("Socket not ready for data\n");
+        return 1;
+      }
+      // The module needs a moment after the prompt before it accepts data
+      delay(50);
+      serial.write(data, chunk);
+      metrics.bytesTx += chunk;
+      sprintf(expected, "%s%d,%d", SARA_SOCKET_WRITE_OK, socket, chunk);
+      if (!getResponse(expected, 10000))
+      {
+        printToConsole("Socket write failed\n");
+        return 1;
+      }
+      data += chunk;
+      size -= chunk;
+    }
+    return 0;
   }
 
-  free(command);
-  return result;
-}
-
-/**
- * @brief Login to the MQTT broker
- * @return 0 if successful, 1 if not
- */
-int loginMQTT()
-{
-  int result = 1;
-  unsigned long SARA_IP_CONNECT_TIMEOUT = 60000;
-
-  // Empties buffer and transmits the command
-  transmitCommand(SARA_LOGIN);
-
-  if (getResponse(SARA_LOGIN_OK, SARA_IP_CONNECT_TIMEOUT))
+  /**
+   * @brief Reads the data the module has buffered for a socket, without waiting for more
+   * @param socket Socket number from socketOpen()
+   * @param buf Receive buffer
+   * @param size Size of the receive buffer
+   * @return Number of bytes read, 0 if none are buffered, -1 on error
+   */
+  int socketRead(int socket, uint8_t *buf, int size)
   {
-    printToConsole("MQTT login successfull\n");
-    result = 0;
+    char header[16];
+    int index = 0;
+    int c;
+    formatCommand("%s%s%d,%d", AT, SARA_SOCKET_READ, socket, size);
+    transmitCommand(command);
+    if (!getResponse(SARA_SOCKET_READ_OK, 1000))
+    {
+      return -1;
+    }
+    // +USORD: <socket>,<length>,"<data>", the data is raw bytes and may hold anything. With nothing
+    // buffered the module may leave out the data: +USORD: <socket>,0
+    unsigned long timeIn = millis();
+    while ((c = readByte(timeIn, 1000)) >= 0 && c != '"' && c != '\r' && c != '\n' &&
+           index < (int)sizeof(header) - 1)
+    {
+      header[index++] = c;
+    }
+    header[index] = '\0';
+    const char *comma = strchr(header, ',');
+    if (comma == NULL || (c != '"' && c != '\r' && c != '\n'))
+    {
+      return -1;
+    }
+    int length = atoi(comma + 1);
+    if (c != '"')
+    {
+      getResponse("OK", 1000);
+      return length == 0 ? 0 : -1;
+    }
+    if (length > size)
+    {
+      return -1;
+    }
+    for (index = 0; index < length; index++)
+    {
+      if ((c = readByte(timeIn, 1000)) < 0)
+      {
+        return -1;
+      }
+      buf[index] = c;
+    }
+    getResponse("OK", 1000);
+    return length;
   }
-  else
+
+  /**
+   * @brief Closes a socket
+   * @param socket Socket number from socketOpen()
+   * @return 0 if successful, 1 if not
+   */
+  int socketClose(int socket)
   {
-    printToConsole("Error logging in to MQTT\n");
+    formatCommand("%s%s%d", AT, SARA_SOCKET_CLOSE, socket);
+    transmitCommand(command);
+    return getResponse("OK", 10000) ? 0 : 1;
   }
-  return result;
-}
-
-/**
- * @brief Configures MQTT Will topic
- * @param topic The topic to publish to
- * @return 0 if successful, 1 if not, 2 if memory allocation failed
- */
-int willconfigMQTT(const char *topic)
-{
-  int result = 1;
-  char *command = NULL;
-  unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
 
-  command = (char *)malloc(strlen(AT) + strlen(SARA_WILL_TOPIC_MQTT) + strlen(topic) + 10);
-  if (command == NULL)
+  /**
+   * @brief Share of the logins with a cached session that resumed it
+   * @return Hit rate in percent, -1 if no login had a session to resume
+   */
+  int tlsHitRate()
   {
-    printToConsole("Malloc failed");
-    return 2;
+    if (tls.offered == 0)
+    {
+      return -1;
+    }
+    return tls.resumed * 100 / tls.offered;
   }
-  sprintf(command, "%s%s%d,%d,\"%s\"", AT, SARA_WILL_TOPIC_MQTT, 0, 0, topic);
-
-  // Empties buffer and transmits the command
-  transmitCommand(command);
 
-  if (getResponse(SARA_TOPIC_OK, SARA_IP_CONNECT_TIMEOUT))
+  /**
+   * @brief Starts a batch. Until endBatch(), commands are queued and sent as concatenated command
+   * @brief lines (AT+A;+B;+C), which saves a round trip per command
+   * @details Only functions that send one command and wait for a fixed confirmation can be batched:
+   * @details assignCert(), enableSSL(), setMQTTid(), setMQTTauth(), setMQTT(), willconfigMQTT(),
+   * @details willmsgMQTT(), setMQTTping() and enableMQTTkeepalive(). While batching they return 0 and
+   * @details print nothing, as nothing has been sent yet. endBatch() returns and reports the real result.
+   */
+  void beginBatch()
   {
-    Serial.println("Will topic set\n");
-    result = 0;
+    batching = 1;
+    batchCount = 0;
+    batchLen = 0;
+    batchFailed = 0;
+    batchTotal = 0;
   }
-  else
+
+  /**
+   * @brief Sends the queued commands and ends the batch. The response is split back into per command
+   * @brief results, commands that are not confirmed are sent again one by one
+   * @return 0 if all commands succeeded, 1 if not
+   */
+  int endBatch()
   {
-    Serial.println("Will topic not set\n");
+    flushBatch();
+    batching = 0;
+    char msgToPrint[64];
+    if (batchFailed)
+    {
+      sprintf(msgToPrint, "%d of %d batched commands failed\n", batchFailed, batchTotal);
+      printToConsole(msgToPrint);
+      return 1;
+    }
+    sprintf(msgToPrint, "%d batched commands confirmed\n", batchTotal);
+    printToConsole(msgToPrint);
+    return 0;
   }
 
-  free(command);
+protected:
+  char command[AT_COMMAND_SIZE];
+  char response[AT_RESPONSE_SIZE];
+  int batching;
+  at_batch_cmd_t batchCmds[AT_BATCH_MAX];
+  int batchCount;
+  char batch[AT_COMMAND_SIZE]; // Concatenated command line
+  int batchLen;
+  int batchFailed; // Commands of the current batch that failed, also when sent one by one
+  int batchTotal;  // Commands queued since beginBatch()
+
+  /**
+   * @brief Prints the outcome of a command, unless the command is only queued in a batch
+   */
+  void printStatus(const char *text)
+  {
+    if (!batching)
+    {
+      printToConsole(text);
+    }
+  }
 
-  return result;
-}
+  /**
+   * @brief Adds a command to the batch line, sends the batch first if it is full
+   */
+  void queueBatch(const char *text)
+  {
+    // Every command but the first is appended without "AT", after a semicolon
+    const char *part = strncmp(text, "AT", 2) == 0 ? text + 2 : text;
+    int len = strlen(part);
+    char pending[AT_COMMAND_SIZE];
+    if (batchCount == AT_BATCH_MAX || 2 + batchLen + 1 + len + 1 > (int)sizeof(batch))
+    {
+      // Commands that are sent again one by one reuse the command buffer the new command is in
+      memcpy(pending, part, len + 1);
+      part = pending;
+      flushBatch();
+    }
+    if (batchCount == 0)
+    {
+      memcpy(batch, AT, 2);
+      batchLen = 2;
+    }
+    else
+    {
+      batch[batchLen++] = ';';
+    }
+    at_batch_cmd_t *cmd = &batchCmds[batchCount++];
+    batchTotal++;
+    cmd->start = batchLen;
+    cmd->len = len;
+    cmd->expected = "OK";
+    cmd->timeout = 1000;
+    cmd->confirmed = 0;
+    memcpy(batch + batchLen, part, len);
+    batchLen += len;
+    batch[batchLen] = '\0';
+  }
 
-/**
- * @brief Configures MQTT Will message
- * @param message The message to publish
- * @return 0 if successful, 1 if not, 2 if memory allocation failed
- */
-int willmsgMQTT(const char *message)
-{
-  int result = 1;
-  char *command = NULL;
+  /**
+   * @brief Sends the batch line and matches the response lines to the commands in order
+   * @details The module runs the commands in order and stops at the first error. An information
+   * @details response of a later command therefore also confirms the earlier commands that only
+   * @details answer with the final OK.
+   */
+  void flushBatch()
+  {
+    if (batchCount == 0)
+    {
+      return;
+    }
+    batching = 0;
+    int timeout = 0;
+    for (int i = 0; i < batchCount; i++)
+    {
+      timeout = batchCmds[i].timeout > timeout ? batchCmds[i].timeout : timeout;
+    }
 
-  unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
+    int next = 0; // First command that is not confirmed
+    if (batchCount > 1)
+    {
+      transmitCommand(batch);
+      unsigned long timeIn = millis();
+      char line[64];
+      int len = 0;
+      int done = 0;
+      int c;
+      while (!done && (c = readByte(timeIn, timeout)) >= 0)
+      {
+        if (c != '\n')
+        {
+          if (c != '\r' && len < (int)sizeof(line) - 1)
+          {
+            line[len++] = c;
+          }
+          continue;
+        }
+        line[len] = '\0';
+        len = 0;
+        if (strcmp(line, "OK") == 0)
+        {
+          // The commands that only answer OK are confirmed, the others had to answer before
+          for (; next < batchCount; next++)
+          {
+            batchCmds[next].confirmed = strcmp(batchCmds[next].expected, "OK") == 0;
+          }
+          done = 1;
+        }
+        else if (strncmp(line, "ERROR", 5) == 0 || strncmp(line, "+CME ERROR", 10) == 0)
+        {
+          done = 1;
+        }
+        else
+        {
+          for (int i = next; i < batchCount; i++)
+          {
+            const char *expected = batchCmds[i].expected;
+            if (strcmp(expected, "OK") != 0 && strncmp(line, expected, strlen(expected)) == 0)
+            {
+              for (; next <= i; next++)
+              {
+                batchCmds[next].confirmed = strcmp(batchCmds[next].expected, "OK") == 0 || next == i;
+              }
+              break;
+            }
+          }
+        }
+      }
+      metrics.responseMs += millis() - timeIn;
+    }
 
-  command = (char *)malloc(strlen(AT) + strlen(SARA_WILL_MESSAGE_MQTT) + strlen(message) + 10);
-  if (command == NULL)
-  {
-    printToConsole("Malloc failed\n");
-    return 2;
+    // Fall back to one by one for everything the batch did not confirm
+    int resent = 0;
+    for (int i = 0; i < batchCount; i++)
+    {
+      at_batch_cmd_t *cmd = &batchCmds[i];
+      if (cmd->confirmed)
+      {
+        continue;
+      }
+      resent++;
+      if (formatCommand("%s%.*s", AT, cmd->len, batch + cmd->start))
+      {
+        batchFailed++;
+        continue;
+      }
+      transmitCommand(command);
+      if (!getResponse(cmd->expected, cmd->timeout))
+      {
+        printToConsole("Batched command failed: ");
+        printToConsole(command);
+        printToConsole("\n");
+        batchFailed++;
+      }
+    }
+    if (batchCount > 1)
+    {
+      char msgToPrint[64];
+      sprintf(msgToPrint, "Batch of %d commands, %d sent again one by one\n", batchCount, resent);
+      printToConsole(msgToPrint);
+    }
+    batchCount = 0;
+    batchLen = 0;
+    batching = 1;
   }
-  sprintf(command, "%s%s\"%s\"", AT, SARA_WILL_MESSAGE_MQTT, message);
 
-  // Empties buffer and transmits the command
-  transmitCommand(command);
-
-  if (getResponse(SARA_MESSAGE_OK, SARA_IP_CONNECT_TIMEOUT))
+  /**
+   * @brief Reads one byte from the module
+   * @param timeIn Start of the wait, from millis()
+   * @param timeout Timeout in milliseconds
+   * @return The byte, -1 on timeout
+   */
+  int readByte(unsigned long timeIn, int timeout)
   {
-    Serial.println("Will message set\n");
-    result = 0;
+    while (millis() - timeIn < (unsigned long)timeout)
+    {
+      if (serial.available())
+      {
+        metrics.bytesRx++;
+        return serial.read();
+      }
+    }
+    metrics.timeouts++;
+    return -1;
   }
-  else
+
+  /**
+   * @brief Updates the TLS statistics after a successful login
+   * @details The module does not report whether it resumed the session. A login with a cached
+   * @details session that takes less than TLS_RESUMED_PERCENT of an average full handshake is counted
+   * @details as resumed, as the certificate exchange and at least one round trip are skipped.
+   * @param elapsed Login time in milliseconds
+   */
+  void recordHandshake(unsigned long elapsed)
   {
-    Serial.println("Will message not set\n");
+    char text[64];
+    int resumed = 0;
+    if (tlsResumption && tlsSession)
+    {
+      tls.offered++;
+      // Without a full handshake to compare with, e.g. right after a wake, assume it was resumed
+      resumed = tls.full == 0 || elapsed * 100 < tls.fullMs / tls.full * TLS_RESUMED_PERCENT;
+    }
+    if (resumed)
+    {
+      tls.resumed++;
+      tls.resumedMs += elapsed;
+    }
+    else
+    {
+      tls.full++;
+      tls.fullMs += elapsed;
+    }
+    tls.lastMs = elapsed;
+    tlsSession = tlsResumption;
+    sprintf(text, "%s TLS handshake, login took %lu ms\n", resumed ? "Resumed" : "Full", elapsed);
+    printToConsole(text);
   }
-  free(command);
-  return result;
-}
 
-/**
- * @brief Configures MQTT broker hostname and port
- * @param hostname The hostname of the MQTT broker
- * @param port The port of the MQTT broker
- * @return 0 if successful, 1 if not, 2 if memory allocation failed
- */
-int setMQTT(const char *host, int port)
-{
-  int result = 1;
-  char *command = NULL;
-  unsigned long SARA_IP_CONNECT_TIMEOUT = 10000;
-
-  command = (char *)malloc(sizeof(char) * (strlen(SARA_CONNECT_MQTT) + strlen(host) + 15));
-  if (command == NULL)
+  /**
+   * @brief Sends the certificate import command and waits until the module is ready for the data
+   * @return 0 if ready, 1 if not, 2 if the command does not fit the command buffer
+   */
+  int startCertImport(int size, int type, const char *name)
   {
-    printToConsole("Malloc failed\n");
-    return 2;
-  }
-  // Create the command
-  sprintf(command, "AT%s=%d,\"%s\",%d", SARA_CONNECT_MQTT, 2, host, port);
-  // Send the command
-  printToConsole("Setting MQTT hostname & port\n");
+    if (formatCommand("%s%s%d,\"%s\",%d", AT, SARA_IMPORT_CERT, type, name, size))
+    {
+      return 2;
+    }
+    printToConsole("Importing certificate: ");
+    printToConsole(name);
+    printToConsole("\n");
+    // Empties buffer and transmits the command
+    transmitCommand(command);
 
-  // Empties buffer and transmits the command
-  transmitCommand(command);
+    if (!getResponse(SARA_IMPORT_CERT_READY, 10000))
+    {
+      printToConsole("Failed to import certificate - not ready\n");
+      return 1;
+    }
+    printToConsole("Ready to receive certificate:\n");
+    while (serial.available())
+    {
+      serial.read();
+      metrics.bytesRx++;
+    }
+    return 0;
+  }
 
-  // Wait for the response
-  if (getResponse(SARA_RESPONSE_OK, SARA_IP_CONNECT_TIMEOUT))
+  /**
+   * @brief Waits for the module to confirm a certificate import, after all data has been written
+   * @return 0 if successful, 1 if not
+   */
+  int finishCertImport(int type)
   {
-    printToConsole("MQTT hostname & port set\n");
-    result = 0;
+    char expected[24];
+    sprintf(expected, "%s%d", SARA_IMPORT_CERT_OK, type);
+    if (getResponse(expected, 10000))
+    {
+      printToConsole("Certificate imported\n");
+      return 0;
+    }
+    printToConsole("Certificate import failed\n");
+    return 1;
   }
-  else
+
+  /**
+   * @brief Formats a command into the command buffer
+   * @return 0 if successful, 1 if the command does not fit
+   */
+  int formatCommand(const char *format, ...)
   {
-    printToConsole("MQTT hostname & port not set\n");
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(command, sizeof(command), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(command))
+    {
+      printToConsole("Command too long\n");
+      return 1;
+    }
+    return 0;
   }
+};
 
-  free(command);
-  return result;
-}
\ No newline at end of file
+#endif // NB_R410M_H
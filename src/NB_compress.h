@@ -0,0 +1,227 @@
+/**
+ * @file NB_compress.h
+ * @author Bergma
+ * @brief LZ compression of uplink payloads against a static dictionary
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Telemetry messages are short and repeat the same keys and text, so they hardly compress on
+ * @details their own. Here every message is compressed as if it followed a pre-trained dictionary
+ * @details (src/NB_dictionary.h, built by tools/compress/train_dict.py from sample payloads), so the
+ * @details repeated parts become 2 byte matches into the dictionary. The dictionary is const and stays in
+ * @details flash. Compressing and decompressing use no memory besides the caller's buffers, and the
+ * @details encoder searches the dictionary directly, without hash tables.
+ * @details Frame format: COMPRESS_MAGIC, COMPRESS_DICT_VERSION, then tokens. A control byte below 0x80 is
+ * @details followed by that many + 1 literal bytes. From 0x80 it is a match of ((c >> 3) & 0x0F) + 3 bytes,
+ * @details at distance ((c & 7) << 8 | next byte) + 1 back in the dictionary followed by the output so far.
+ * @details The backend decoder is tools/compress/nbcompress.py.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_COMPRESS_H
+#define NB_COMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "NB_dictionary.h"
+
+#define COMPRESS_MAGIC 0xC1 // Never valid in UTF-8, so a frame can not be mistaken for a text message
+#define COMPRESS_TEXT_PREFIX "~z" // Start of a frame sent as base64 text
+#define COMPRESS_MIN_MATCH 3
+#define COMPRESS_MAX_MATCH 18
+#define COMPRESS_MAX_DISTANCE 2048
+// Largest frame for a message of n bytes, when nothing matches
+#define COMPRESS_BOUND(n) ((n) + (n) / 128 + 3)
+// Largest base64 text for a frame of n bytes, including the prefix and terminator
+#define COMPRESS_TEXT_BOUND(n) (((n) + 2) / 3 * 4 + sizeof(COMPRESS_TEXT_PREFIX))
+
+/**
+ * @brief Byte at a position in the dictionary followed by the message
+ */
+inline uint8_t compressHistory(const uint8_t *data, int pos)
+{
+  const int dictSize = sizeof(COMPRESS_DICT);
+  return pos < dictSize ? COMPRESS_DICT[pos] : data[pos - dictSize];
+}
+
+/**
+ * @brief Writes the pending literals to the frame
+ * @return The new frame length, -1 if the frame buffer is too small
+ */
+inline int compressFlush(const uint8_t *literals, int count, uint8_t *out, int outLen, int size)
+{
+  while (count > 0)
+  {
+    int run = count > 128 ? 128 : count;
+    if (outLen + 1 + run > size)
+    {
+      return -1;
+    }
+    out[outLen++] = run - 1;
+    memcpy(&out[outLen], literals, run);
+    outLen += run;
+    literals += run;
+    count -= run;
+  }
+  return outLen;
+}
+
+/**
+ * @brief Compresses a message against the static dictionary
+ * @param in The message
+ * @param len Length of the message
+ * @param out Buffer for the frame, COMPRESS_BOUND(len) bytes is always enough
+ * @param size Size of the buffer
+ * @return Length of the frame, -1 if it does not fit the buffer
+ */
+inline int compressPayload(const uint8_t *in, int len, uint8_t *out, int size)
+{
+  const int dictSize = sizeof(COMPRESS_DICT);
+  if (size < 2)
+  {
+    return -1;
+  }
+  out[0] = COMPRESS_MAGIC;
+  out[1] = COMPRESS_DICT_VERSION;
+  int outLen = 2;
+  int literalStart = 0;
+  int i = 0;
+
+  while (i < len)
+  {
+    // Longest match in the window, the nearest one if there are several
+    int pos = dictSize + i;
+    int limit = len - i < COMPRESS_MAX_MATCH ? len - i : COMPRESS_MAX_MATCH;
+    int lowest = pos > COMPRESS_MAX_DISTANCE ? pos - COMPRESS_MAX_DISTANCE : 0;
+    int bestLen = 0;
+    int bestDist = 0;
+    for (int start = pos - 1; start >= lowest && bestLen < limit; start--)
+    {
+      if (compressHistory(in, start) != in[i])
+      {
+        continue;
+      }
+      int n = 1;
+      while (n < limit && compressHistory(in, start + n) == in[i + n])
+      {
+        n++;
+      }
+      if (n > bestLen)
+      {
+        bestLen = n;
+        bestDist = pos - start;
+      }
+    }
+
+    if (bestLen < COMPRESS_MIN_MATCH)
+    {
+      i++;
+      continue;
+    }
+    outLen = compressFlush(&in[literalStart], i - literalStart, out, outLen, size);
+    if (outLen < 0 || outLen + 2 > size)
+    {
+      return -1;
+    }
+    int distance = bestDist - 1;
+    out[outLen++] = 0x80 | (bestLen - COMPRESS_MIN_MATCH) << 3 | distance >> 8;
+    out[outLen++] = distance & 0xFF;
+    i += bestLen;
+    literalStart = i;
+  }
+  return compressFlush(&in[literalStart], len - literalStart, out, outLen, size);
+}
+
+/**
+ * @brief Decompresses a frame written by compressPayload(). Only needed for checks on the device,
+ * @brief the backend uses tools/compress/nbcompress.py
+ * @param in The frame
+ * @param len Length of the frame
+ * @param out Buffer for the message
+ * @param size Size of the buffer
+ * @return Length of the message, -1 if the frame is malformed, for another dictionary or too long for the buffer
+ */
+inline int decompressPayload(const uint8_t *in, int len, uint8_t *out, int size)
+{
+  const int dictSize = sizeof(COMPRESS_DICT);
+  if (len < 2 || in[0] != COMPRESS_MAGIC || in[1] != COMPRESS_DICT_VERSION)
+  {
+    return -1;
+  }
+  int outLen = 0;
+  int pos = 2;
+  while (pos < len)
+  {
+    uint8_t c = in[pos++];
+    if (c < 0x80)
+    {
+      int run = c + 1;
+      if (pos + run > len || outLen + run > size)
+      {
+        return -1;
+      }
+      memcpy(&out[outLen], &in[pos], run);
+      pos += run;
+      outLen += run;
+      continue;
+    }
+    if (pos >= len)
+    {
+      return -1;
+    }
+    int matchLen = ((c >> 3) & 0x0F) + COMPRESS_MIN_MATCH;
+    int start = dictSize + outLen - (((c & 0x07) << 8 | in[pos++]) + 1);
+    if (start < 0 || outLen + matchLen > size)
+    {
+      return -1;
+    }
+    // Byte by byte, a match may overlap the bytes it produces
+    for (int n = 0; n < matchLen; n++, start++)
+    {
+      out[outLen++] = compressHistory(out, start);
+    }
+  }
+  return outLen;
+}
+
+/**
+ * @brief Encodes a frame as COMPRESS_TEXT_PREFIX followed by base64, for the AT MQTT client that only sends text
+ * @param frame The frame from compressPayload()
+ * @param len Length of the frame
+ * @param text Buffer for the text, COMPRESS_TEXT_BOUND(len) bytes is always enough
+ * @param size Size of the buffer
+ * @return Length of the text without the terminator, -1 if it does not fit the buffer
+ */
+inline int compressToText(const uint8_t *frame, int len, char *text, int size)
+{
+  static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int textLen = sizeof(COMPRESS_TEXT_PREFIX) - 1;
+  if (textLen + (len + 2) / 3 * 4 + 1 > size)
+  {
+    return -1;
+  }
+  memcpy(text, COMPRESS_TEXT_PREFIX, textLen);
+  for (int i = 0; i < len; i += 3)
+  {
+    uint32_t bits = (uint32_t)frame[i] << 16;
+    if (i + 1 < len)
+    {
+      bits |= frame[i + 1] << 8;
+    }
+    if (i + 2 < len)
+    {
+      bits |= frame[i + 2];
+    }
+    text[textLen++] = BASE64[bits >> 18];
+    text[textLen++] = BASE64[(bits >> 12) & 0x3F];
+    text[textLen++] = i + 1 < len ? BASE64[(bits >> 6) & 0x3F] : '=';
+    text[textLen++] = i + 2 < len ? BASE64[bits & 0x3F] : '=';
+  }
+  text[textLen] = '\0';
+  return textLen;
+}
+
+#endif // NB_COMPRESS_H
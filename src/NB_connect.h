@@ -0,0 +1,99 @@
+/**
+ * @file NB_connect.h
+ * @author Bergma
+ * @brief The security profile and MQTT configuration that precede the first login
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details configureConnection() is the part of the connection sequence that initConnection() in
+ * @details src/main.cpp, tools/fleet_sim and tools/replay have in common, so the simulated devices and the
+ * @details replay send the same commands as the firmware. The steps before it are platform specific: power
+ * @details cycling, waiting for the network, importing the certificates and, with SAS_AUTH, setting the
+ * @details username and token. loginMQTT() follows it.
+ * @details The security profile is reset first: the module keeps certificates assigned to it across
+ * @details reboots, so a client certificate from an earlier provisioning would otherwise still be sent.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_CONNECT_H
+#define NB_CONNECT_H
+
+#include "NB_R410M.h"
+
+/**
+ * @brief Settings of the broker connection
+ */
+typedef struct
+{
+  const char *host;        // Broker hostname, also the name the server certificate is checked against
+  int port;
+  const char *identity;    // MQTT client ID
+  const char *willTopic;
+  const char *willMessage;
+  int keepalive;           // MQTT keepalive in seconds
+  int profile;             // Security profile used by MQTT
+  const char *caName;      // Names the certificates were imported under
+  const char *certName;    // NULL to log in without a client certificate, e.g. with a SAS token
+  const char *keyName;
+  int resumption;          // Enable TLS session resumption
+  int batch;               // Send the configuration as concatenated command lines, see beginBatch()
+} connect_config_t;
+
+/**
+ * @brief Resets the security profile, assigns the certificates and configures the MQTT client
+ * @param modem The module to configure
+ * @param config Connection settings
+ * @return 0 if successful, 1 if a command failed
+ */
+template <class Modem>
+int configureConnection(Modem &modem, const connect_config_t *config)
+{
+  int result = 0;
+
+  // Start from the defaults, a profile provisioned earlier may still hold other certificates
+  result |= modem.resetSecurityProfile(config->profile);
+
+  // Let later logins resume the TLS session instead of a full handshake
+  if (config->resumption)
+  {
+    result |= modem.enableSessionResumption(config->profile);
+  }
+
+  // Commands the module does not confirm in a batch are sent again one by one
+  if (config->batch)
+  {
+    modem.beginBatch();
+  }
+
+  // Assign the certificates to the security profile
+  result |= modem.assignCert(config->profile, config->host, 4);
+  result |= modem.assignCert(config->profile, config->caName, 3);
+  if (config->certName != NULL)
+  {
+    result |= modem.assignCert(config->profile, config->certName, 5);
+    result |= modem.assignCert(config->profile, config->keyName, 6);
+  }
+
+  // Set the security profile to be used by MQTT
+  result |= modem.enableSSL(config->profile);
+
+  // Client ID, broker and Last Will
+  result |= modem.setMQTTid(config->identity);
+  result |= modem.setMQTT(config->host, config->port);
+  result |= modem.willconfigMQTT(config->willTopic);
+  result |= modem.willmsgMQTT(config->willMessage);
+
+  // Enable MQTT keepalive
+  result |= modem.setMQTTping(config->keepalive);
+  result |= modem.enableMQTTkeepalive();
+
+  if (config->batch)
+  {
+    result |= modem.endBatch();
+  }
+  return result ? 1 : 0;
+}
+
+#endif // NB_CONNECT_H
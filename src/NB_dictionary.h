@@ -0,0 +1,45 @@
+// Generated by tools/compress/train_dict.py from sample payloads - do not edit
+#ifndef NB_DICTIONARY_H
+#define NB_DICTIONARY_H
+
+#include <stdint.h>
+
+#define COMPRESS_DICT_VERSION 2
+
+// 512 bytes
+const uint8_t COMPRESS_DICT[] = {
+  0x6f, 0x72, 0x6c, 0x64, 0x20, 0x66, 0x72, 0x6f, 0x22, 0x73, 0x65, 0x71, 0x22, 0x3a, 0x32, 0x2c,
+  0x22, 0x74, 0x65, 0x6d, 0x70, 0x22, 0x3a, 0x31, 0x37, 0x2e, 0x31, 0x2c, 0x22, 0x68, 0x75, 0x6d,
+  0x68, 0x75, 0x6d, 0x22, 0x3a, 0x33, 0x36, 0x2e, 0x38, 0x2c, 0x22, 0x62, 0x61, 0x74, 0x22, 0x3a,
+  0x33, 0x2e, 0x36, 0x32, 0x2c, 0x22, 0x72, 0x73, 0x22, 0x3a, 0x2d, 0x31, 0x31, 0x35, 0x2c, 0x22,
+  0x72, 0x73, 0x72, 0x71, 0x22, 0x3a, 0x2d, 0x31, 0x31, 0x2c, 0x22, 0x65, 0x63, 0x6c, 0x22, 0x3a,
+  0x2e, 0x39, 0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a, 0x33, 0x31, 0x2e, 0x34, 0x2c, 0x22, 0x62,
+  0x61, 0x74, 0x22, 0x3a, 0x33, 0x2e, 0x39, 0x39, 0x32, 0x2e, 0x36, 0x2c, 0x22, 0x62, 0x61, 0x74,
+  0x22, 0x3a, 0x33, 0x2e, 0x37, 0x32, 0x2c, 0x22, 0x72, 0x73, 0x72, 0x70, 0x22, 0x3a, 0x2d, 0x39,
+  0x6d, 0x70, 0x22, 0x3a, 0x32, 0x30, 0x2e, 0x30, 0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a, 0x34,
+  0x30, 0x2e, 0x33, 0x2c, 0x22, 0x62, 0x61, 0x74, 0x6d, 0x70, 0x22, 0x3a, 0x31, 0x35, 0x2e, 0x38,
+  0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a, 0x34, 0x33, 0x2e, 0x35, 0x2c, 0x22, 0x62, 0x61, 0x74,
+  0x22, 0x3a, 0x2d, 0x31, 0x30, 0x38, 0x2c, 0x22, 0x72, 0x73, 0x72, 0x71, 0x22, 0x3a, 0x2d, 0x31,
+  0x34, 0x2c, 0x22, 0x65, 0x63, 0x6c, 0x22, 0x3a, 0x72, 0x70, 0x22, 0x3a, 0x2d, 0x38, 0x37, 0x2c,
+  0x22, 0x72, 0x73, 0x72, 0x71, 0x22, 0x3a, 0x2d, 0x31, 0x33, 0x2c, 0x22, 0x65, 0x63, 0x6c, 0x22,
+  0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a, 0x33, 0x33, 0x2e, 0x37, 0x2c, 0x22, 0x62, 0x61, 0x74, 0x22,
+  0x3a, 0x34, 0x2e, 0x30, 0x31, 0x2c, 0x22, 0x72, 0x3a, 0x2d, 0x39, 0x30, 0x2c, 0x22, 0x72, 0x73,
+  0x72, 0x71, 0x22, 0x3a, 0x2d, 0x31, 0x30, 0x2c, 0x22, 0x65, 0x63, 0x6c, 0x22, 0x3a, 0x31, 0x7d,
+  0x61, 0x74, 0x22, 0x3a, 0x33, 0x2e, 0x38, 0x32, 0x2c, 0x22, 0x72, 0x73, 0x72, 0x70, 0x22, 0x3a,
+  0x2d, 0x31, 0x31, 0x31, 0x2c, 0x22, 0x72, 0x73, 0x3a, 0x2d, 0x31, 0x30, 0x33, 0x2c, 0x22, 0x72,
+  0x73, 0x72, 0x71, 0x22, 0x3a, 0x2d, 0x39, 0x2c, 0x22, 0x65, 0x63, 0x6c, 0x22, 0x3a, 0x32, 0x7d,
+  0x65, 0x6d, 0x70, 0x22, 0x3a, 0x32, 0x33, 0x2e, 0x36, 0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a,
+  0x35, 0x38, 0x2e, 0x35, 0x2c, 0x22, 0x62, 0x61, 0x30, 0x61, 0x33, 0x63, 0x38, 0x66, 0x34, 0x65,
+  0x7c, 0x48, 0x65, 0x6c, 0x6c, 0x6f, 0x20, 0x57, 0x6f, 0x72, 0x6c, 0x64, 0x20, 0x66, 0x72, 0x6f,
+  0x3a, 0x2d, 0x31, 0x30, 0x39, 0x2c, 0x22, 0x72, 0x73, 0x72, 0x71, 0x22, 0x3a, 0x2d, 0x38, 0x2c,
+  0x22, 0x65, 0x63, 0x6c, 0x22, 0x3a, 0x30, 0x7d, 0x35, 0x2c, 0x22, 0x74, 0x65, 0x6d, 0x70, 0x22,
+  0x3a, 0x31, 0x38, 0x2e, 0x34, 0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22, 0x3a, 0x34, 0x39, 0x2e, 0x33,
+  0x20, 0x57, 0x6f, 0x72, 0x6c, 0x64, 0x20, 0x66, 0x72, 0x6f, 0x6d, 0x20, 0x4e, 0x42, 0x5f, 0x49,
+  0x6f, 0x54, 0x20, 0x6d, 0x6f, 0x64, 0x75, 0x6c, 0x2e, 0x30, 0x2c, 0x22, 0x68, 0x75, 0x6d, 0x22,
+  0x3a, 0x33, 0x32, 0x2e, 0x31, 0x2c, 0x22, 0x62, 0x61, 0x74, 0x22, 0x3a, 0x33, 0x2e, 0x35, 0x36,
+  0x2c, 0x22, 0x72, 0x73, 0x72, 0x70, 0x22, 0x3a, 0x2d, 0x31, 0x30, 0x31, 0x2c, 0x22, 0x72, 0x73,
+  0x72, 0x71, 0x22, 0x3a, 0x2d, 0x31, 0x30, 0x2c, 0x7c, 0x7b, 0x22, 0x64, 0x65, 0x76, 0x69, 0x63,
+  0x65, 0x22, 0x3a, 0x22, 0x6e, 0x62, 0x31, 0x22, 0x2c, 0x22, 0x73, 0x65, 0x71, 0x22, 0x3a, 0x31,
+};
+
+#endif // NB_DICTIONARY_H
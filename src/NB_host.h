@@ -0,0 +1,33 @@
+/**
+ * @file NB_host.h
+ * @author Bergma
+ * @brief Platform functions the driver needs when it is built for a host instead of the ESP32
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details NB_R410M.h includes this file when ARDUINO is not defined. The host program
+ * @details (simulator, benchmarks, replay tool) must provide the definitions.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_HOST_H
+#define NB_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t byte;
+
+/**
+ * @brief Milliseconds since the program (or the simulated device) started
+ */
+unsigned long millis();
+
+/**
+ * @brief Blocks for the given number of milliseconds
+ */
+void delay(unsigned long ms);
+
+#endif // NB_HOST_H
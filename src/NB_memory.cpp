@@ -0,0 +1,135 @@
+/**
+ * @file NB_memory.cpp
+ * @author Bergma
+ * @brief Counters of NB_memory.h and the malloc() wrappers, which must be defined once in the program
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details The wrappers are only built with MEMORY_CHECK, see NB_memory.h for the linker options.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "NB_memory.h"
+
+mem_stats_t memStats = {0, 0, 0, 0, 0, 0};
+volatile int memoryLocked = 0;
+#ifdef ARDUINO
+TaskHandle_t memoryLockTask = NULL;
+portMUX_TYPE memoryMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+#ifdef MEMORY_CHECK
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+  void __real_free(void *ptr);
+
+  size_t memoryBlockSize(void *ptr)
+  {
+#ifdef ARDUINO
+    return heap_caps_get_allocated_size(ptr);
+#else
+    return malloc_usable_size(ptr);
+#endif
+  }
+
+  /**
+   * @brief Checks an allocation against the lock, before it is made
+   */
+  void memoryCheck(size_t size)
+  {
+#ifdef ARDUINO
+    if (!memoryLocked || xTaskGetCurrentTaskHandle() != memoryLockTask)
+    {
+      return;
+    }
+#else
+    if (!memoryLocked)
+    {
+      return;
+    }
+#endif
+    memStats.lockedAllocs++;
+    memStats.lockedBytes += size;
+#ifdef MEMORY_STRICT
+    char msgToPrint[64];
+    snprintf(msgToPrint, sizeof(msgToPrint), "Heap allocation of %u bytes after init\n", (unsigned)size);
+    printToConsole(msgToPrint);
+    abort();
+#endif
+  }
+
+  void memoryAdd(void *ptr)
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+    size_t size = memoryBlockSize(ptr);
+#ifdef ARDUINO
+    portENTER_CRITICAL(&memoryMux);
+#endif
+    memStats.allocs++;
+    memStats.liveBytes += size;
+    if (memStats.liveBytes > memStats.peakBytes)
+    {
+      memStats.peakBytes = memStats.liveBytes;
+    }
+#ifdef ARDUINO
+    portEXIT_CRITICAL(&memoryMux);
+#endif
+  }
+
+  void memoryRemove(void *ptr)
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+    size_t size = memoryBlockSize(ptr);
+#ifdef ARDUINO
+    portENTER_CRITICAL(&memoryMux);
+#endif
+    memStats.frees++;
+    memStats.liveBytes -= size < memStats.liveBytes ? size : memStats.liveBytes;
+#ifdef ARDUINO
+    portEXIT_CRITICAL(&memoryMux);
+#endif
+  }
+
+  void *__wrap_malloc(size_t size)
+  {
+    memoryCheck(size);
+    void *ptr = __real_malloc(size);
+    memoryAdd(ptr);
+    return ptr;
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    memoryCheck(count * size);
+    void *ptr = __real_calloc(count, size);
+    memoryAdd(ptr);
+    return ptr;
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size)
+  {
+    memoryCheck(size);
+    memoryRemove(ptr);
+    void *moved = __real_realloc(ptr, size);
+    memoryAdd(moved != NULL || size == 0 ? moved : ptr);
+    return moved;
+  }
+
+  void __wrap_free(void *ptr)
+  {
+    memoryRemove(ptr);
+    __real_free(ptr);
+  }
+}
+#endif // MEMORY_CHECK
@@ -0,0 +1,117 @@
+/**
+ * @file NB_memory.h
+ * @author Bergma
+ * @brief Heap and stack instrumentation, and a mode that fails on heap allocations after initialization
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details memoryCheckpoint() prints the free heap, the lowest free heap since boot, the largest free
+ * @details block (a drop in it while the free heap stays the same is fragmentation) and the stack high
+ * @details water mark of the tasks in MEMORY_TASKS. Call it at the end of setup() and now and then from loop().
+ * @details Built with MEMORY_CHECK and linked with -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc
+ * @details every malloc() is counted as well, with the bytes in use and their peak. The wrappers are in
+ * @details NB_memory.cpp, which has to be linked into the program. Call memoryLock() once initialization is
+ * @details done: later allocations by the same task are counted separately, and with MEMORY_STRICT they
+ * @details abort the program. Other tasks (timers, the TCP/IP stack) are not checked.
+ * @details Allocations that bypass malloc(), e.g. FreeRTOS objects, only show in the free heap figures.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_MEMORY_H
+#define NB_MEMORY_H
+
+#include "NB_R410M.h"
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#else
+#include <malloc.h>
+#endif
+
+#ifndef MEMORY_TASKS
+#define MEMORY_TASKS {"loopTask", "esp_timer", "Tmr Svc", "IDLE0", "IDLE1"} // Tasks whose stack is reported
+#endif
+
+/**
+ * @brief Heap allocations through malloc(), counted with MEMORY_CHECK
+ */
+typedef struct
+{
+  unsigned long allocs;       // Allocations since boot
+  unsigned long frees;
+  unsigned long lockedAllocs; // Allocations by the locked task after memoryLock()
+  size_t lockedBytes;         // Bytes requested by those
+  size_t liveBytes;           // Bytes allocated and not freed
+  size_t peakBytes;           // Highest liveBytes
+} mem_stats_t;
+
+// Defined in NB_memory.cpp, together with the malloc() wrappers
+extern mem_stats_t memStats;
+extern volatile int memoryLocked;
+#ifdef ARDUINO
+extern TaskHandle_t memoryLockTask;
+extern portMUX_TYPE memoryMux;
+#endif
+
+/**
+ * @brief Marks the end of initialization. From now on allocations by the calling task are violations
+ */
+inline void memoryLock()
+{
+#ifdef ARDUINO
+  memoryLockTask = xTaskGetCurrentTaskHandle();
+#endif
+  memoryLocked = 1;
+}
+
+/**
+ * @brief Allows allocations again, e.g. before a full reinitialization
+ */
+inline void memoryUnlock()
+{
+  memoryLocked = 0;
+}
+
+
+/**
+ * @brief Prints the heap figures and the stack high water marks
+ * @param phase Printed with the figures, e.g. "setup" or "loop"
+ */
+inline void memoryCheckpoint(const char *phase)
+{
+#if defined(ARDUINO) || defined(MEMORY_CHECK)
+  char msgToPrint[160];
+#endif
+#ifdef ARDUINO
+  snprintf(msgToPrint, sizeof(msgToPrint), "[mem] %s: heap free %u, min free %u, largest block %u\n", phase,
+           (unsigned)heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+           (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT),
+           (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+  printToConsole(msgToPrint);
+
+  const char *tasks[] = MEMORY_TASKS;
+  for (unsigned i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++)
+  {
+    TaskHandle_t task = xTaskGetHandle(tasks[i]);
+    if (task != NULL)
+    {
+      // In bytes on the ESP32
+      snprintf(msgToPrint, sizeof(msgToPrint), "[mem] %s: stack %s never used %u\n", phase, tasks[i],
+               (unsigned)uxTaskGetStackHighWaterMark(task));
+      printToConsole(msgToPrint);
+    }
+  }
+#endif
+#ifdef MEMORY_CHECK
+  snprintf(msgToPrint, sizeof(msgToPrint),
+           "[mem] %s: %lu allocs, %lu frees, %u bytes live, %u peak, %lu after init (%u bytes)\n", phase,
+           memStats.allocs, memStats.frees, (unsigned)memStats.liveBytes, (unsigned)memStats.peakBytes,
+           memStats.lockedAllocs, (unsigned)memStats.lockedBytes);
+  printToConsole(msgToPrint);
+#endif
+}
+
+#endif // NB_MEMORY_H
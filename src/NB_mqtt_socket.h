@@ -0,0 +1,512 @@
+/**
+ * @file NB_mqtt_socket.h
+ * @author Bergma
+ * @brief MQTT 3.1.1 client on the ESP32, over a TCP/TLS socket of the module
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details NB_R410M_socket has the same MQTT functions as NB_R410M, but instead of configuring the
+ * @details module's MQTT client it keeps the settings itself, opens a socket with AT+USOCR/AT+USOCO
+ * @details and writes the MQTT packets with AT+USOWR. That allows binary payloads (publishBinary())
+ * @details and avoids the text escaping and length limits of AT+UMQTTC. QoS 0 and 1 are supported.
+ * @details Build with MQTT_SOCKET to make lteModem an NB_R410M_socket. Call pollMQTT() from loop(),
+ * @details as the client has to send the keepalive pings itself.
+ * @details Everything is kept in fixed buffers, MQTT_PACKET_SIZE limits the size of one packet.
+ * @details The settings are only kept in RAM, in settings. NB_resume.h keeps a copy in RTC memory, so
+ * @details they survive deep sleep when initConnection() is skipped.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_MQTT_SOCKET_H
+#define NB_MQTT_SOCKET_H
+
+#include "NB_R410M.h"
+
+#ifndef MQTT_PACKET_SIZE
+#define MQTT_PACKET_SIZE 512 // Largest MQTT packet sent or received
+#endif
+#ifndef MQTT_POLL_INTERVAL
+#define MQTT_POLL_INTERVAL 100 // Time between socket reads while waiting for a packet
+#endif
+
+// MQTT packet types, the upper nibble of the first byte
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+/**
+ * @brief Settings of the MQTT client, as set by setMQTTid(), setMQTT() etc.
+ */
+typedef struct
+{
+  char clientId[64];
+  char host[64];
+  int port;
+  int profile; // Security profile, -1 for a plain TCP connection
+  char willTopic[64];
+  char willMessage[64];
+  char username[128];
+  char password[256]; // Fits a SAS token
+  int keepalive;
+} mqtt_settings_t;
+
+template <class Transport>
+class NB_R410M_socket : public NB_R410M<Transport>
+{
+public:
+  int socket;   // Socket number, -1 if not open
+  int loggedIn; // 1 while the broker connection is up
+  mqtt_settings_t settings;
+
+  NB_R410M_socket(Transport &transport)
+      : NB_R410M<Transport>(transport), socket(-1), loggedIn(0), packetId(0), lastTxMs(0), rxLen(0), rxBodyLen(0),
+        rxUsed(0)
+  {
+    memset(&settings, 0, sizeof(settings));
+    settings.profile = -1;
+    settings.keepalive = 60;
+  }
+
+  /**
+   * @brief Selects the security profile used for the TLS socket
+   * @param profile SSL profile number
+   * @return 0
+   */
+  int enableSSL(int profile)
+  {
+    settings.profile = profile;
+    this->tlsSession = 0;
+    return 0;
+  }
+
+  /**
+   * @brief Sets the MQTT client ID
+   * @param id MQTT ID
+   * @return 0 if successful, 2 if it is too long
+   */
+  int setMQTTid(const char *id) { return copySetting(settings.clientId, sizeof(settings.clientId), id); }
+
+  /**
+   * @brief Sets the username and password sent in CONNECT
+   * @return 0 if successful, 2 if one of them is too long
+   */
+  int setMQTTauth(const char *username, const char *password)
+  {
+    if (copySetting(settings.username, sizeof(settings.username), username))
+    {
+      return 2;
+    }
+    return copySetting(settings.password, sizeof(settings.password), password);
+  }
+
+  /**
+   * @brief Sets the broker hostname and port
+   * @return 0 if successful, 2 if the hostname is too long
+   */
+  int setMQTT(const char *host, int port)
+  {
+    settings.port = port;
+    return copySetting(settings.host, sizeof(settings.host), host);
+  }
+
+  /**
+   * @brief Sets the Last Will topic
+   * @return 0 if successful, 2 if it is too long
+   */
+  int willconfigMQTT(const char *topic) { return copySetting(settings.willTopic, sizeof(settings.willTopic), topic); }
+
+  /**
+   * @brief Sets the Last Will message
+   * @return 0 if successful, 2 if it is too long
+   */
+  int willmsgMQTT(const char *message)
+  {
+    return copySetting(settings.willMessage, sizeof(settings.willMessage), message);
+  }
+
+  /**
+   * @brief Sets the keepalive interval sent in CONNECT
+   * @param timeout Keepalive in seconds
+   * @return 0
+   */
+  int setMQTTping(int timeout)
+  {
+    settings.keepalive = timeout;
+    return 0;
+  }
+
+  /**
+   * @brief Keepalive pings are sent by pollMQTT()
+   * @return 0
+   */
+  int enableMQTTkeepalive() { return 0; }
+
+  /**
+   * @brief Opens the socket and logs in to the broker
+   * @return 0 if successful, 1 if not
+   */
+  int loginMQTT()
+  {
+    closeSocket();
+    socket = this->socketOpen();
+    if (socket < 0)
+    {
+      return 1;
+    }
+    if (settings.profile >= 0 && this->socketSecure(socket, settings.profile))
+    {
+      closeSocket();
+      return 1;
+    }
+    // The TLS handshake is part of the connect
+    unsigned long start = millis();
+    if (this->socketConnect(socket, settings.host, settings.port))
+    {
+      printToConsole("Error logging in to MQTT\n");
+      this->tlsSession = 0;
+      closeSocket();
+      return 1;
+    }
+
+    // Variable header: protocol name, level 4, flags, keepalive. Payload: client ID, will, username, password
+    int flags = 0x02; // Clean session
+    if (settings.willTopic[0] != '\0')
+    {
+      flags |= 0x04;
+    }
+    if (settings.username[0] != '\0')
+    {
+      flags |= 0x80 | 0x40;
+    }
+    int length = 10 + 2 + strlen(settings.clientId);
+    if (flags & 0x04)
+    {
+      length += 2 + strlen(settings.willTopic) + 2 + strlen(settings.willMessage);
+    }
+    if (flags & 0x80)
+    {
+      length += 2 + strlen(settings.username) + 2 + strlen(settings.password);
+    }
+    int pos = putHeader(MQTT_CONNECT << 4, length);
+    if (pos < 0)
+    {
+      closeSocket();
+      return 1;
+    }
+    pos = putString(pos, "MQTT", 4);
+    packet[pos++] = 4;
+    packet[pos++] = flags;
+    packet[pos++] = settings.keepalive >> 8;
+    packet[pos++] = settings.keepalive & 0xFF;
+    pos = putString(pos, settings.clientId, strlen(settings.clientId));
+    if (flags & 0x04)
+    {
+      pos = putString(pos, settings.willTopic, strlen(settings.willTopic));
+      pos = putString(pos, settings.willMessage, strlen(settings.willMessage));
+    }
+    if (flags & 0x80)
+    {
+      pos = putString(pos, settings.username, strlen(settings.username));
+      pos = putString(pos, settings.password, strlen(settings.password));
+    }
+
+    uint8_t type;
+    int bodyLen;
+    unsigned long handshake = millis() - start;
+    if (send(pos) || readPacket(&type, &bodyLen, 10000) || type != MQTT_CONNACK || bodyLen < 2 || body()[1] != 0)
+    {
+      printToConsole("Error logging in to MQTT\n");
+      this->tlsSession = 0;
+      closeSocket();
+      return 1;
+    }
+    loggedIn = 1;
+    printToConsole("MQTT login successfull\n");
+    if (settings.profile >= 0)
+    {
+      this->recordHandshake(handshake);
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Sends DISCONNECT and closes the socket
+   * @return 0 if successful, 1 if the connection was already down
+   */
+  int logoutMQTT()
+  {
+    if (!loggedIn)
+    {
+      closeSocket();
+      return 1;
+    }
+    packet[0] = MQTT_DISCONNECT << 4;
+    packet[1] = 0;
+    if (send(2))
+    {
+      printToConsole("Error logging out of MQTT\n");
+      return 1;
+    }
+    closeSocket();
+    printToConsole("MQTT logout successfull\n");
+    return 0;
+  }
+
+  /**
+   * @brief Publishes a text message
+   * @param topic The topic to publish to
+   * @param message The message to publish
+   * @param QoS QoS 0 or 1, 2 is sent as 1
+   * @param retain Whether to retain the message
+   * @return 0 if successful, 1 if not, 2 if the message does not fit MQTT_PACKET_SIZE
+   */
+  int publishMessage(const char *topic, const char *message, int QoS, int retain)
+  {
+    return publishBinary(topic, (const uint8_t *)message, strlen(message), QoS, retain);
+  }
+
+  /**
+   * @brief Publishes a message that may hold any bytes
+   * @param topic The topic to publish to
+   * @param data The payload
+   * @param size Payload size in bytes
+   * @param QoS QoS 0 or 1, 2 is sent as 1
+   * @param retain Whether to retain the message
+   * @return 0 if successful, 1 if not, 2 if the message does not fit MQTT_PACKET_SIZE
+   */
+  int publishBinary(const char *topic, const uint8_t *data, int size, int QoS, int retain)
+  {
+    unsigned long SARA_SEND_TIMEOUT = 60000;
+    if (!loggedIn)
+    {
+      return 1;
+    }
+    QoS = QoS > 0 ? 1 : 0;
+    int topicLen = strlen(topic);
+    int pos = putHeader((MQTT_PUBLISH << 4) | (QoS << 1) | (retain ? 1 : 0), 2 + topicLen + (QoS ? 2 : 0) + size);
+    if (pos < 0)
+    {
+      printToConsole("Message too long\n");
+      return 2;
+    }
+    pos = putString(pos, topic, topicLen);
+    uint16_t id = 0;
+    if (QoS)
+    {
+      id = nextId();
+      packet[pos++] = id >> 8;
+      packet[pos++] = id & 0xFF;
+    }
+    memcpy(packet + pos, data, size);
+    pos += size;
+    if (send(pos))
+    {
+      printToConsole("Error sending message\n");
+      return 1;
+    }
+
+    unsigned long timeIn = millis();
+    while (QoS)
+    {
+      uint8_t type;
+      int bodyLen;
+      unsigned long waited = millis() - timeIn;
+      if (waited >= SARA_SEND_TIMEOUT || readPacket(&type, &bodyLen, SARA_SEND_TIMEOUT - waited))
+      {
+        printToConsole("Error sending message\n");
+        return 1;
+      }
+      if (type == MQTT_PUBACK && bodyLen >= 2 && ((body()[0] << 8) | body()[1]) == id)
+      {
+        break;
+      }
+    }
+    printToConsole("Message sent\n");
+    return 0;
+  }
+
+  /**
+   * @brief Sends a keepalive ping when the connection has been idle for half the keepalive interval,
+   * @brief and handles incoming packets. Call this from loop()
+   * @return 0 if connected, 1 if not
+   */
+  int pollMQTT()
+  {
+    if (!loggedIn)
+    {
+      return 1;
+    }
+    if (millis() - lastTxMs >= (unsigned long)settings.keepalive * 500)
+    {
+      packet[0] = MQTT_PINGREQ << 4;
+      packet[1] = 0;
+      uint8_t type;
+      int bodyLen;
+      if (send(2) || readPacket(&type, &bodyLen, 10000))
+      {
+        printToConsole("MQTT ping failed\n");
+        closeSocket();
+        return 1;
+      }
+      if (type != MQTT_PINGRESP)
+      {
+        // Nothing is subscribed and publishMessage() reads its own PUBACK, so only PINGRESP is valid here
+        printToConsole("Unexpected MQTT packet, connection closed\n");
+        closeSocket();
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+protected:
+  uint16_t packetId;
+  unsigned long lastTxMs;
+  uint8_t packet[MQTT_PACKET_SIZE]; // Packet being sent
+  uint8_t rx[MQTT_PACKET_SIZE];     // Received bytes, the first packet starts at rx[0]
+  int rxLen;
+  int rxBodyLen;
+  int rxUsed; // Size of the packet returned by readPacket(), dropped on the next call
+
+  int copySetting(char *dest, int size, const char *value)
+  {
+    if ((int)strlen(value) >= size)
+    {
+      return 2;
+    }
+    strcpy(dest, value);
+    return 0;
+  }
+
+  uint16_t nextId()
+  {
+    if (++packetId == 0)
+    {
+      packetId = 1;
+    }
+    return packetId;
+  }
+
+  /**
+   * @brief Writes the fixed header into packet
+   * @return Position after the header, -1 if the packet does not fit
+   */
+  int putHeader(uint8_t type, int length)
+  {
+    int pos = 0;
+    packet[pos++] = type;
+    int remaining = length;
+    do
+    {
+      uint8_t b = remaining & 0x7F;
+      remaining >>= 7;
+      packet[pos++] = remaining ? b | 0x80 : b;
+    } while (remaining);
+    return pos + length <= MQTT_PACKET_SIZE ? pos : -1;
+  }
+
+  int putString(int pos, const char *text, int len)
+  {
+    packet[pos++] = len >> 8;
+    packet[pos++] = len & 0xFF;
+    memcpy(packet + pos, text, len);
+    return pos + len;
+  }
+
+  int send(int size)
+  {
+    if (socket < 0 || this->socketWrite(socket, packet, size))
+    {
+      closeSocket();
+      return 1;
+    }
+    lastTxMs = millis();
+    return 0;
+  }
+
+  const uint8_t *body() const { return rx + rxUsed - rxBodyLen; }
+
+  /**
+   * @brief Waits for the next complete packet. Its body is at body() until the next call
+   * @param type Packet type, the upper nibble of the first byte
+   * @param bodyLen Length of the body
+   * @param timeout Timeout in milliseconds
+   * @return 0 if successful, 1 on timeout or error
+   */
+  int readPacket(uint8_t *type, int *bodyLen, unsigned long timeout)
+  {
+    // Drop the packet returned by the previous call
+    if (rxUsed > 0)
+    {
+      memmove(rx, rx + rxUsed, rxLen - rxUsed);
+      rxLen -= rxUsed;
+      rxUsed = 0;
+    }
+    unsigned long timeIn = millis();
+    while (1)
+    {
+      // Remaining length is 1-4 bytes after the type
+      int length = 0;
+      int pos = 1;
+      int shift = 0;
+      while (pos < rxLen && pos <= 4)
+      {
+        length |= (rx[pos] & 0x7F) << shift;
+        shift += 7;
+        if (!(rx[pos++] & 0x80))
+        {
+          break;
+        }
+      }
+      int complete = rxLen > 1 && !(rx[pos - 1] & 0x80) && rxLen >= pos + length;
+      if (rxLen > 1 && pos + length > MQTT_PACKET_SIZE)
+      {
+        closeSocket();
+        return 1;
+      }
+      if (complete)
+      {
+        *type = rx[0] >> 4;
+        *bodyLen = length;
+        rxBodyLen = length;
+        rxUsed = pos + length;
+        return 0;
+      }
+      if (millis() - timeIn >= timeout)
+      {
+        return 1;
+      }
+      int n = this->socketRead(socket, rx + rxLen, MQTT_PACKET_SIZE - rxLen);
+      if (n < 0)
+      {
+        closeSocket();
+        return 1;
+      }
+      rxLen += n;
+      if (n == 0)
+      {
+        delay(MQTT_POLL_INTERVAL);
+      }
+    }
+  }
+
+  void closeSocket()
+  {
+    if (socket >= 0)
+    {
+      this->socketClose(socket);
+    }
+    socket = -1;
+    loggedIn = 0;
+    rxLen = 0;
+    rxUsed = 0;
+  }
+};
+
+#endif // NB_MQTT_SOCKET_H
@@ -0,0 +1,229 @@
+/**
+ * @file NB_netstatus.h
+ * @author Bergma
+ * @brief Network registration from the GPIO16 status indicator of the module, read by interrupt
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details initModule() sets GPIO16 of the module to network status indication (AT+UGPIOC=16,2). With that
+ * @details pin wired to an ESP32 input (it is a 1.8 V output, so through a level shifter) its pattern tells
+ * @details the registration state without any AT traffic:
+ * @details   continuously low                             no service, not registered
+ * @details   100 ms high every 2 s                        registered on the home network
+ * @details   two 100 ms pulses 100 ms apart, every 2 s    registered, roaming
+ * @details   continuously high                            registered, data connection active
+ * @details An interrupt records the edges and wakes the waiting task, netStatusUpdate() decodes them.
+ * @details Call netStatusBegin() once in setup() and netStatusUpdate() from loop(). A change of state is
+ * @details printed and copied to the driver's registration, which NB_scheduler.h uses to hold messages while
+ * @details the module is not registered. netStatusWait() replaces the AT+CEREG? polling of getNetwork(): the
+ * @details task blocks until an edge or a timeout, so with automatic light sleep (esp_pm_configure()) the
+ * @details ESP32 sleeps until the network is up.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_NETSTATUS_H
+#define NB_NETSTATUS_H
+
+#include "NB_R410M.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <soc/gpio_reg.h>
+#include <soc/soc.h>
+
+#define NETSTATUS_UNKNOWN 0    // No pattern seen yet
+#define NETSTATUS_NO_SERVICE 1 // Not registered
+#define NETSTATUS_HOME 2       // Registered, home network
+#define NETSTATUS_ROAMING 3    // Registered, roaming
+#define NETSTATUS_DATA 4       // Registered, data connection active
+
+#ifndef NETSTATUS_PAIR_MS
+#define NETSTATUS_PAIR_MS 400 // Longest time between the rising edges of the roaming double pulse
+#endif
+#ifndef NETSTATUS_STEADY_MS
+#define NETSTATUS_STEADY_MS 3000 // Time without an edge after which the level itself is the state
+#endif
+
+// Defined by the program, see src/main.cpp
+extern int netStatusPin;
+extern TaskHandle_t netStatusTask; // Task woken by an edge
+extern portMUX_TYPE netStatusMux;
+extern volatile unsigned long netLastEdge; // millis() of the last edge
+extern volatile unsigned long netLastRise; // millis() of the last rising edge
+extern volatile uint8_t netLevel;
+extern volatile uint8_t netDouble; // The current pulse is the second one of a double pulse
+extern int netState;
+extern unsigned long netStatusChanges;
+
+/**
+ * @brief Reads the status pin from the GPIO input registers. Unlike digitalRead() this is safe in an ISR
+ * @brief while the flash cache is disabled
+ */
+inline uint8_t IRAM_ATTR netStatusLevel()
+{
+  if (netStatusPin < 32)
+  {
+    return (REG_READ(GPIO_IN_REG) >> netStatusPin) & 1;
+  }
+  return (REG_READ(GPIO_IN1_REG) >> (netStatusPin - 32)) & 1;
+}
+
+/**
+ * @brief Records an edge of the status pin and wakes the waiting task
+ */
+inline void IRAM_ATTR netStatusISR()
+{
+  unsigned long now = millis();
+  uint8_t level = netStatusLevel();
+  portENTER_CRITICAL_ISR(&netStatusMux);
+  if (level && !netLevel)
+  {
+    netDouble = now - netLastRise < NETSTATUS_PAIR_MS;
+    netLastRise = now;
+  }
+  netLevel = level;
+  netLastEdge = now;
+  portEXIT_CRITICAL_ISR(&netStatusMux);
+
+  if (netStatusTask != NULL)
+  {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(netStatusTask, &woken);
+    if (woken)
+    {
+      portYIELD_FROM_ISR();
+    }
+  }
+}
+
+/**
+ * @brief Starts reading the status pin. The calling task is the one netStatusWait() wakes
+ * @param pin ESP32 pin that GPIO16 of the module is wired to
+ */
+inline void netStatusBegin(int pin)
+{
+  netStatusPin = pin;
+  pinMode(pin, INPUT);
+  netLevel = netStatusLevel();
+  netLastEdge = millis();
+  netLastRise = netLastEdge - NETSTATUS_STEADY_MS; // No pulse yet
+  netState = NETSTATUS_UNKNOWN;
+  netStatusTask = xTaskGetCurrentTaskHandle();
+  attachInterrupt(digitalPinToInterrupt(pin), netStatusISR, CHANGE);
+}
+
+/**
+ * @brief Decodes the recorded edges
+ * @return One of the NETSTATUS_ states, the previous state while a pulse is still being decoded
+ */
+inline int netStatusDecode()
+{
+  portENTER_CRITICAL(&netStatusMux);
+  unsigned long lastEdge = netLastEdge;
+  unsigned long lastRise = netLastRise;
+  uint8_t level = netLevel;
+  uint8_t pair = netDouble;
+  portEXIT_CRITICAL(&netStatusMux);
+
+  unsigned long now = millis();
+  if (now - lastEdge >= NETSTATUS_STEADY_MS)
+  {
+    return level ? NETSTATUS_DATA : NETSTATUS_NO_SERVICE;
+  }
+  // A pulse is only known to be single once a second one can no longer follow. A fall long after the
+  // last rise ends a continuous high, not a pulse
+  if (!level && now - lastRise >= NETSTATUS_PAIR_MS && now - lastRise < NETSTATUS_STEADY_MS)
+  {
+    return pair ? NETSTATUS_ROAMING : NETSTATUS_HOME;
+  }
+  return netState;
+}
+
+/**
+ * @brief Checks if a state means the module is registered
+ */
+inline int netStatusRegistered(int state)
+{
+  return state == NETSTATUS_HOME || state == NETSTATUS_ROAMING || state == NETSTATUS_DATA;
+}
+
+/**
+ * @brief Decodes the status pin and handles a change of state. Call this from loop()
+ * @param modem The module on the status pin, its registration is updated
+ * @return One of the NETSTATUS_ states
+ */
+template <class Modem>
+int netStatusUpdate(Modem &modem)
+{
+  static const char *const NAMES[] = {"unknown", "no service", "registered, home network",
+                                      "registered, roaming", "registered, data connection"};
+  int state = netStatusDecode();
+  if (state == netState)
+  {
+    return netState;
+  }
+  netState = state;
+  netStatusChanges++;
+
+  // Same meaning as the +CEREG status, so the rest of the driver does not have to ask the module
+  switch (state)
+  {
+  case NETSTATUS_NO_SERVICE:
+    modem.registration = 2;
+    break;
+  case NETSTATUS_HOME:
+    modem.registration = 1;
+    break;
+  case NETSTATUS_ROAMING:
+    modem.registration = 5;
+    break;
+  case NETSTATUS_DATA:
+    if (modem.registration != 1 && modem.registration != 5)
+    {
+      modem.registration = 1;
+    }
+    break;
+  }
+
+  char msgToPrint[64];
+  snprintf(msgToPrint, sizeof(msgToPrint), "Network status: %s\n", NAMES[state]);
+  printToConsole(msgToPrint);
+  return netState;
+}
+
+/**
+ * @brief Blocks until the status pin shows registration. The task sleeps between edges
+ * @param modem The module on the status pin
+ * @param timeout Timeout in milliseconds
+ * @return 0 if registered, 1 if the timeout expired
+ */
+template <class Modem>
+int netStatusWait(Modem &modem, unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (!netStatusRegistered(netStatusUpdate(modem)))
+  {
+    unsigned long now = millis();
+    if (now - start >= timeout)
+    {
+      return 1;
+    }
+    // Sleep until the next edge, or until the state can change without one
+    unsigned long wait = timeout - (now - start);
+    unsigned long sinceRise = now - netLastRise;
+    unsigned long sinceEdge = now - netLastEdge;
+    if (sinceRise < NETSTATUS_PAIR_MS)
+    {
+      wait = wait < NETSTATUS_PAIR_MS - sinceRise ? wait : NETSTATUS_PAIR_MS - sinceRise;
+    }
+    else if (sinceEdge < NETSTATUS_STEADY_MS)
+    {
+      wait = wait < NETSTATUS_STEADY_MS - sinceEdge ? wait : NETSTATUS_STEADY_MS - sinceEdge;
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait) + 1);
+  }
+  return 0;
+}
+
+#endif // NB_NETSTATUS_H
@@ -0,0 +1,217 @@
+/**
+ * @file NB_resume.h
+ * @author Bergma
+ * @brief Keeps modem and MQTT session state in RTC memory across ESP32 deep sleep
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details The module stays powered while the ESP32 is in deep sleep, so after a wake it is
+ * @details usually still initialized, registered and logged in to the broker. Call saveSession()
+ * @details once setup has completed, and resumeSession() at the start of setup(). If the state in
+ * @details RTC memory is valid, was written for the same configuration and the module confirms it
+ * @details is registered, the full initialization can be skipped.
+ * @details With MQTT_SOCKET the MQTT client runs on the ESP32 and its settings only exist in RAM, so they
+ * @details are kept here as well, together with the socket the module may still hold open.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_RESUME_H
+#define NB_RESUME_H
+
+#include "NB_R410M.h"
+#ifdef MQTT_SOCKET
+#include "NB_mqtt_socket.h"
+#endif
+#include <esp_sleep.h>
+#include <stddef.h>
+
+#define SESSION_MAGIC 0x4E42524D // "NBRM"
+
+/**
+ * @brief Session state kept in RTC slow memory
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t profileHash; // Hash of the configuration the session was set up with
+  uint8_t initDone;     // initModule() and setAPN() completed
+  uint8_t registered;   // getNetwork() completed
+  uint8_t certsLoaded;  // Certificates imported, assigned and the MQTT client configured
+  uint8_t mqttLoggedIn; // loginMQTT() succeeded
+  uint8_t tlsResumption; // TLS session resumption enabled on the MQTT security profile
+  uint8_t tlsSession;    // The module holds a TLS session it can resume
+  char ip[16];          // Last IP address from printInfo()
+#ifdef MQTT_SOCKET
+  mqtt_settings_t mqtt; // Settings of the MQTT client on the ESP32
+  int8_t socket;        // Its socket when the ESP32 went to sleep, -1 if none
+#endif
+  uint32_t checksum;
+} session_state_t;
+
+/**
+ * @brief Results of the setup steps, 1 for each step that succeeded
+ */
+typedef struct
+{
+  int initDone;
+  int registered;
+  int certsLoaded;
+  int mqttLoggedIn;
+} session_steps_t;
+
+// Defined by the program in RTC memory, see src/main.cpp
+extern session_state_t sessionState;
+
+/**
+ * @brief FNV-1a hash, used for the configuration hash and the state checksum
+ * @param data Data to hash
+ * @param len Number of bytes
+ * @param hash Previous hash value, 2166136261 to start a new hash
+ * @return Updated hash
+ */
+inline uint32_t hashBytes(const void *data, int len, uint32_t hash)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  for (int i = 0; i < len; i++)
+  {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+/**
+ * @brief Hashes a list of configuration strings, e.g. APN, hostname, client ID
+ * @param items Strings to hash
+ * @param count Number of strings
+ * @return Configuration hash
+ */
+inline uint32_t hashConfig(const char *const *items, int count)
+{
+  uint32_t hash = 2166136261;
+  for (int i = 0; i < count; i++)
+  {
+    // Include the terminator so "ab","c" and "a","bc" differ
+    hash = hashBytes(items[i], strlen(items[i]) + 1, hash);
+  }
+  return hash;
+}
+
+/**
+ * @brief Calculates the checksum of the session state, excluding the checksum itself
+ */
+inline uint32_t sessionChecksum()
+{
+  return hashBytes(&sessionState, offsetof(session_state_t, checksum), 2166136261);
+}
+
+/**
+ * @brief Forgets the stored session, the next boot runs the full initialization
+ */
+inline void invalidateSession()
+{
+  sessionState.magic = 0;
+}
+
+/**
+ * @brief Stores the session state in RTC memory
+ * @param modem The module the session was set up on
+ * @param profileHash Configuration hash from hashConfig()
+ * @param ip IP address from printInfo(), may be NULL
+ * @param steps Which setup steps succeeded. The session is only resumed if all of them did
+ */
+template <class Modem>
+void saveSession(Modem &modem, uint32_t profileHash, const char *ip, const session_steps_t *steps)
+{
+  memset(&sessionState, 0, sizeof(sessionState));
+  sessionState.magic = SESSION_MAGIC;
+  sessionState.profileHash = profileHash;
+  sessionState.initDone = steps->initDone ? 1 : 0;
+  sessionState.registered = steps->registered ? 1 : 0;
+  sessionState.certsLoaded = steps->certsLoaded ? 1 : 0;
+  sessionState.mqttLoggedIn = steps->mqttLoggedIn ? 1 : 0;
+  sessionState.tlsResumption = modem.tlsResumption;
+  sessionState.tlsSession = modem.tlsSession;
+  if (ip != NULL)
+  {
+    strncpy(sessionState.ip, ip, sizeof(sessionState.ip) - 1);
+  }
+#ifdef MQTT_SOCKET
+  sessionState.mqtt = modem.settings;
+  sessionState.socket = modem.socket;
+#endif
+  sessionState.checksum = sessionChecksum();
+}
+
+/**
+ * @brief Checks whether the previous session can be reused after a wake from deep sleep
+ * @param modem The module the session was set up on, it is restored on success
+ * @param profileHash Configuration hash from hashConfig()
+ * @return 0 if the session was resumed, 1 if the full initialization must be run
+ */
+template <class Modem>
+int resumeSession(Modem &modem, uint32_t profileHash)
+{
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED)
+  {
+    // Power on or reset, RTC memory does not hold a session
+    invalidateSession();
+    return 1;
+  }
+  if (sessionState.magic != SESSION_MAGIC || sessionState.checksum != sessionChecksum())
+  {
+    printToConsole("No valid session in RTC memory\n");
+    return 1;
+  }
+  if (sessionState.profileHash != profileHash)
+  {
+    printToConsole("Configuration changed, session discarded\n");
+    invalidateSession();
+    return 1;
+  }
+  if (!sessionState.initDone || !sessionState.registered || !sessionState.certsLoaded || !sessionState.mqttLoggedIn)
+  {
+    return 1;
+  }
+
+  // A single query confirms the module is alive, configured and still registered
+  modem.serial.begin(115200);
+  int stat = modem.queryRegistration();
+  if (stat != 1 && stat != 5)
+  {
+    printToConsole("Module not registered, session discarded\n");
+    invalidateSession();
+    return 1;
+  }
+  strcpy(modem.ip, sessionState.ip);
+  modem.tlsResumption = sessionState.tlsResumption;
+  modem.tlsSession = sessionState.tlsSession;
+#ifdef MQTT_SOCKET
+  // The broker connection has to be made again, the next login closes the old socket first
+  modem.settings = sessionState.mqtt;
+  modem.socket = sessionState.socket;
+#endif
+  printToConsole("Session resumed\n");
+  return 0;
+}
+
+/**
+ * @brief Puts the ESP32 in deep sleep. The module stays powered and keeps its session
+ * @param modem The module the session was set up on
+ * @param ms Sleep time in milliseconds
+ */
+template <class Modem>
+void sleepFor(Modem &modem, unsigned long ms)
+{
+#ifdef MQTT_SOCKET
+  // Logins in loop() may have opened another socket
+  sessionState.socket = modem.socket;
+  sessionState.checksum = sessionChecksum();
+#endif
+  esp_sleep_enable_timer_wakeup((uint64_t)ms * 1000);
+  esp_deep_sleep_start();
+}
+
+#endif // NB_RESUME_H
@@ -0,0 +1,277 @@
+/**
+ * @file NB_sas.h
+ * @author Bergma
+ * @brief Azure IoT Hub SAS token authentication for the MQTT login
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Instead of a client certificate the device logs in with its MQTT username and a shared
+ * @details access signature as password. The TLS handshake then only authenticates the server, so it
+ * @details carries no client certificate chain, and the client certificate and key do not have to be
+ * @details imported at boot. The token is "SharedAccessSignature sr=<uri>&sig=<signature>&se=<expiry>",
+ * @details where the signature is the HMAC-SHA256 of "<url encoded uri>\n<expiry>" with the shared access
+ * @details key. The expiry is in Unix time; if the clock has not been synced sasLogin() syncs it first.
+ * @details The module keeps certificates assigned to the security profile, so reset it with
+ * @details resetSecurityProfile() before assigning the CA, or a client certificate from an earlier
+ * @details provisioning is still sent.
+ * @details Call sasConfigure() once and sasLogin() before loginMQTT(). The token is cached in RTC memory
+ * @details and reused across deep sleep. Call serviceSasToken() from loop(): it renews the token
+ * @details SAS_RENEW_MARGIN seconds before it expires and logs in again with the new one, before the
+ * @details broker drops the connection. If that fails it is tried again every SAS_RETRY_INTERVAL.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_SAS_H
+#define NB_SAS_H
+
+#include "NB_R410M.h"
+#include "NB_time.h"
+#include <ctype.h>
+#include "mbedtls/base64.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/version.h"
+
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+// The functions that return an error code got their plain names in mbedtls 3
+#define mbedtls_sha256_starts mbedtls_sha256_starts_ret
+#define mbedtls_sha256_update mbedtls_sha256_update_ret
+#define mbedtls_sha256_finish mbedtls_sha256_finish_ret
+#endif
+
+#ifndef SAS_TOKEN_SIZE
+#define SAS_TOKEN_SIZE 256 // Longest token, including the terminator
+#endif
+#ifndef SAS_TTL
+#define SAS_TTL 86400 // Lifetime of a new token in seconds
+#endif
+#ifndef SAS_RENEW_MARGIN
+#define SAS_RENEW_MARGIN 3600 // Seconds before expiry at which the token is renewed
+#endif
+#ifndef SAS_RETRY_INTERVAL
+#define SAS_RETRY_INTERVAL 60000 // Milliseconds between attempts after a failed renewal
+#endif
+
+// Defined by the program, see src/main.cpp
+extern char sasToken[SAS_TOKEN_SIZE]; // In RTC memory
+extern uint32_t sasExpiry;            // Unix time the cached token expires, 0 if there is none. In RTC memory
+extern const char *sasUri;
+extern const char *sasKey;
+extern const char *sasKeyName;
+extern const char *sasUsername;
+extern unsigned long sasRetryAt; // millis() value before which serviceSasToken() does not try again
+extern int sasFailed;
+
+/**
+ * @brief URL encodes text, as required for the resource URI and signature in the token
+ * @return Length of the encoded text, -1 if it does not fit the buffer
+ */
+inline int urlEncode(const char *text, char *out, int size)
+{
+  static const char HEX_DIGITS[] = "0123456789ABCDEF";
+  int len = 0;
+  for (const char *p = text; *p; p++)
+  {
+    unsigned char c = *p;
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+    {
+      if (len + 2 > size)
+      {
+        return -1;
+      }
+      out[len++] = c;
+    }
+    else
+    {
+      if (len + 4 > size)
+      {
+        return -1;
+      }
+      out[len++] = '%';
+      out[len++] = HEX_DIGITS[c >> 4];
+      out[len++] = HEX_DIGITS[c & 0x0F];
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+/**
+ * @brief HMAC-SHA256 with the hash context on the stack, as mbedtls_md_hmac() allocates it on the heap
+ * @param key The key, at most 64 bytes
+ * @return 0 if successful, 1 if not
+ */
+inline int hmacSha256(const uint8_t *key, size_t keyLen, const uint8_t *data, size_t len, uint8_t *out)
+{
+  uint8_t pad[64];
+  uint8_t inner[32];
+  mbedtls_sha256_context ctx;
+  int result = 0;
+
+  memset(pad, 0x36, sizeof(pad));
+  for (size_t i = 0; i < keyLen; i++)
+  {
+    pad[i] ^= key[i];
+  }
+  mbedtls_sha256_init(&ctx);
+  result |= mbedtls_sha256_starts(&ctx, 0);
+  result |= mbedtls_sha256_update(&ctx, pad, sizeof(pad));
+  result |= mbedtls_sha256_update(&ctx, data, len);
+  result |= mbedtls_sha256_finish(&ctx, inner);
+
+  for (size_t i = 0; i < sizeof(pad); i++)
+  {
+    pad[i] ^= 0x36 ^ 0x5C;
+  }
+  result |= mbedtls_sha256_starts(&ctx, 0);
+  result |= mbedtls_sha256_update(&ctx, pad, sizeof(pad));
+  result |= mbedtls_sha256_update(&ctx, inner, sizeof(inner));
+  result |= mbedtls_sha256_finish(&ctx, out);
+  mbedtls_sha256_free(&ctx);
+  return result != 0;
+}
+
+/**
+ * @brief Creates a SAS token
+ * @param uri Resource URI, <hostname>/devices/<device id>
+ * @param key Shared access key, base64 encoded as shown by the IoT Hub
+ * @param keyName Name of the shared access policy, NULL or empty for a device key
+ * @param expiry Unix time the token expires
+ * @param token Buffer for the token
+ * @param size Size of the buffer
+ * @return 0 if successful, 1 if the key is not valid base64, 2 if the token does not fit the buffer
+ */
+inline int createSasToken(const char *uri, const char *key, const char *keyName, uint32_t expiry, char *token,
+                          int size)
+{
+  unsigned char decodedKey[64];
+  size_t keyLen;
+  if (mbedtls_base64_decode(decodedKey, sizeof(decodedKey), &keyLen, (const unsigned char *)key, strlen(key)))
+  {
+    return 1;
+  }
+
+  char encodedUri[128];
+  char toSign[160];
+  if (urlEncode(uri, encodedUri, sizeof(encodedUri)) < 0 ||
+      snprintf(toSign, sizeof(toSign), "%s\n%lu", encodedUri, (unsigned long)expiry) >= (int)sizeof(toSign))
+  {
+    return 2;
+  }
+
+  unsigned char hmac[32];
+  if (hmacSha256(decodedKey, keyLen, (const uint8_t *)toSign, strlen(toSign), hmac))
+  {
+    return 1;
+  }
+  char signature[48];
+  char encodedSignature[96];
+  size_t signatureLen;
+  mbedtls_base64_encode((unsigned char *)signature, sizeof(signature), &signatureLen, hmac, sizeof(hmac));
+  urlEncode(signature, encodedSignature, sizeof(encodedSignature));
+
+  int len;
+  if (keyName != NULL && keyName[0] != '\0')
+  {
+    len = snprintf(token, size, "SharedAccessSignature sr=%s&sig=%s&se=%lu&skn=%s", encodedUri, encodedSignature,
+                   (unsigned long)expiry, keyName);
+  }
+  else
+  {
+    len = snprintf(token, size, "SharedAccessSignature sr=%s&sig=%s&se=%lu", encodedUri, encodedSignature,
+                   (unsigned long)expiry);
+  }
+  return len < size ? 0 : 2;
+}
+
+/**
+ * @brief Sets the credentials tokens are created from. The strings must stay valid
+ * @param uri Resource URI, <hostname>/devices/<device id>
+ * @param key Shared access key, base64 encoded
+ * @param keyName Name of the shared access policy, NULL or empty for a device key
+ * @param username MQTT username, <hostname>/<device id>/?api-version=<version>
+ */
+inline void sasConfigure(const char *uri, const char *key, const char *keyName, const char *username)
+{
+  sasUri = uri;
+  sasKey = key;
+  sasKeyName = keyName;
+  sasUsername = username;
+}
+
+/**
+ * @brief Checks if the cached token has to be renewed
+ * @return 1 if there is no token or it expires within SAS_RENEW_MARGIN, 0 if not or if the time is not known
+ */
+inline int sasTokenDue()
+{
+  uint32_t timestamp = getTimestamp();
+  if (timestamp == 0)
+  {
+    return 0;
+  }
+  return sasExpiry == 0 || timestampToUnix(timestamp) + SAS_RENEW_MARGIN >= sasExpiry;
+}
+
+/**
+ * @brief Sets the MQTT username and a valid token as password. Call before loginMQTT(), not in a batch
+ * @param modem The module to log in with
+ * @return 0 if successful, 1 if no token could be created or the module did not accept it, 2 if too long
+ */
+template <class Modem>
+int sasLogin(Modem &modem)
+{
+  // The expiry needs the time, which may not have been available when the clock was synced at boot
+  if (getTimestamp() == 0 && syncNetworkTime(modem))
+  {
+    printToConsole("SAS token needs network time\n");
+    return 1;
+  }
+  if (sasTokenDue())
+  {
+    uint32_t expiry = timestampToUnix(getTimestamp()) + SAS_TTL;
+    int result = createSasToken(sasUri, sasKey, sasKeyName, expiry, sasToken, sizeof(sasToken));
+    if (result)
+    {
+      sasExpiry = 0;
+      printToConsole("Failed to create SAS token\n");
+      return result;
+    }
+    sasExpiry = expiry;
+    printToConsole("SAS token renewed\n");
+  }
+  return modem.setMQTTauth(sasUsername, sasToken);
+}
+
+/**
+ * @brief Renews the token before it expires and logs in again with the new one. Call this from loop()
+ * @details Also creates the first token if that failed at boot. Failed attempts are repeated every
+ * @details SAS_RETRY_INTERVAL, not on every loop().
+ * @param modem The module to log in with
+ * @return 0 if the token is valid and the login succeeded or was not needed, 1 if not
+ */
+template <class Modem>
+int serviceSasToken(Modem &modem)
+{
+  if (sasExpiry != 0 && !sasTokenDue())
+  {
+    return 0;
+  }
+  if (sasFailed && (long)(millis() - sasRetryAt) < 0)
+  {
+    return 1;
+  }
+  if (sasLogin(modem))
+  {
+    sasFailed = 1;
+    sasRetryAt = millis() + SAS_RETRY_INTERVAL;
+    return 1;
+  }
+  sasFailed = 0;
+  // The broker checks the token at login only, so the connection has to be made again
+  modem.logoutMQTT();
+  return modem.loginMQTT();
+}
+
+#endif // NB_SAS_H
@@ -0,0 +1,319 @@
+/**
+ * @file NB_scheduler.h
+ * @author Bergma
+ * @brief Signal quality aware transmission scheduling for the NB_R410M driver
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Messages are queued with scheduleMessage() together with how long they may be delayed.
+ * @details serviceScheduler() must be called from loop(). It samples the signal quality while
+ * @details messages are waiting and only publishes when coverage is good, or when the deadline
+ * @details of a queued message has expired. Messages with no allowed delay are sent immediately.
+ * @details In poor coverage every byte is repeated many times by the network, so holding
+ * @details non-urgent messages saves retries, timeouts and energy. After a flush that leaves messages
+ * @details queued nothing is sent for SCHED_RETRY_MIN, doubled after every further failed flush up to
+ * @details SCHED_RETRY_MAX, as each failure can cost a publish timeout and a new login. Messages that can
+ * @details never be sent (too long for the command or packet) are dropped.
+ * @details Messages are stamped with getTimestamp() when queued and published as
+ * @details "<timestamp in hex>|<message>", so the measurement time survives the delay. Messages queued
+ * @details before the time is known are published without the prefix. Build with SCHED_TIMESTAMPS=0
+ * @details when the receiver does not expect it.
+ * @details The AT MQTT client sends the message unquoted, so the separator must not be a comma (the next
+ * @details parameter) or a semicolon (the next command).
+ * @details With SCHED_COMPRESS set messages are compressed with NB_compress.h when that makes them
+ * @details shorter. With MQTT_SOCKET the frame is published as is, otherwise as base64 text.
+ * @details While the driver's registration shows the module is not registered (kept up to date by
+ * @details NB_netstatus.h) messages are held, also past their deadline.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_SCHEDULER_H
+#define NB_SCHEDULER_H
+
+#include "NB_R410M.h"
+#include "NB_time.h"
+#include "NB_compress.h"
+
+#ifndef SCHED_QUEUE_LEN
+#define SCHED_QUEUE_LEN 8 // Maximum number of queued messages
+#endif
+#ifndef SCHED_MSG_SIZE
+#define SCHED_MSG_SIZE 128 // Maximum message length including terminator
+#endif
+#ifndef SCHED_SAMPLE_INTERVAL
+#define SCHED_SAMPLE_INTERVAL 10000 // Milliseconds between signal quality samples while holding
+#endif
+#ifndef SCHED_TIMESTAMPS
+#define SCHED_TIMESTAMPS 1 // Prefix published messages with the time they were queued
+#endif
+#ifndef SCHED_COMPRESS
+#define SCHED_COMPRESS 0 // Compress published messages against the static dictionary
+#endif
+#ifndef SCHED_MAX_COVERAGE
+#define SCHED_MAX_COVERAGE 1 // Highest coverage class considered good enough to send
+#endif
+#ifndef SCHED_RETRY_MIN
+#define SCHED_RETRY_MIN 30000 // Milliseconds before the first retry after a failed flush
+#endif
+#ifndef SCHED_RETRY_MAX
+#define SCHED_RETRY_MAX 600000 // Longest wait between retries
+#endif
+
+/**
+ * @brief A message waiting to be published
+ */
+typedef struct
+{
+  const char *topic; // Must stay valid until the message is sent
+  char message[SCHED_MSG_SIZE];
+  int QoS;
+  int retain;
+  uint32_t timestamp;     // getTimestamp() when queued, 0 if the time was not known
+  unsigned long deadline; // millis() value after which the message is sent regardless of coverage
+} sched_msg_t;
+
+/**
+ * @brief Scheduler statistics
+ */
+typedef struct
+{
+  unsigned long sent;
+  unsigned long failed;
+  unsigned long dropped;  // Rejected because the queue was full or the message too long to send
+  unsigned long held;     // Number of samples where coverage was too poor to send
+  unsigned long expired;  // Number of flushes forced by a deadline
+  unsigned long samples;
+} sched_stats_t;
+
+// Defined by the program, see src/main.cpp
+extern sched_msg_t schedQueue[SCHED_QUEUE_LEN];
+extern int schedCount;
+extern unsigned long schedLastSample;
+extern int schedSampled;
+extern signal_quality_t schedQuality;
+extern unsigned long schedBackoff; // Current wait after a failed flush, 0 if the last flush succeeded
+extern unsigned long schedRetryAt; // millis() value before which no flush is attempted
+extern int schedLastFailed;        // 1 if the last publish attempt failed, also after logging in again
+extern sched_stats_t schedStats;
+
+/**
+ * @brief Publishes a message, compressed if enabled and if that makes it shorter
+ * @return Return value from NB_R410M::publishMessage()
+ */
+template <class Modem>
+int publishPacked(Modem &modem, const char *topic, const char *message, int QoS, int retain)
+{
+  if (!SCHED_COMPRESS)
+  {
+    return modem.publishMessage(topic, message, QoS, retain);
+  }
+  int len = strlen(message);
+  uint8_t frame[COMPRESS_BOUND(SCHED_MSG_SIZE + 10)];
+  int packed = compressPayload((const uint8_t *)message, len, frame, sizeof(frame));
+#ifdef MQTT_SOCKET
+  if (packed > 0 && packed < len)
+  {
+    return modem.publishBinary(topic, frame, packed, QoS, retain);
+  }
+#else
+  char text[COMPRESS_TEXT_BOUND(sizeof(frame))];
+  if (packed > 0 && compressToText(frame, packed, text, sizeof(text)) > 0 && (int)strlen(text) < len)
+  {
+    return modem.publishMessage(topic, text, QoS, retain);
+  }
+#endif
+  return modem.publishMessage(topic, message, QoS, retain);
+}
+
+/**
+ * @brief Publishes a message, prefixed with its timestamp if enabled and known
+ * @return Return value from NB_R410M::publishMessage()
+ */
+template <class Modem>
+int publishStamped(Modem &modem, const char *topic, const char *message, uint32_t timestamp, int QoS, int retain)
+{
+  if (!SCHED_TIMESTAMPS || timestamp == 0)
+  {
+    return publishPacked(modem, topic, message, QoS, retain);
+  }
+  char stamped[SCHED_MSG_SIZE + 10];
+  snprintf(stamped, sizeof(stamped), "%08lx|%s", (unsigned long)timestamp, message);
+  return publishPacked(modem, topic, stamped, QoS, retain);
+}
+
+/**
+ * @brief Publishes all queued messages in the order they were queued. Messages that fail stay queued,
+ * @brief messages that can never be sent are dropped
+ * @details After the first failed publish the MQTT login is redone once. If publishing still fails the
+ * @details flush stops there and the remaining messages wait for the next flush, delayed by the backoff.
+ * @param modem The module to publish with
+ * @return Number of messages that could not be sent
+ */
+template <class Modem>
+int flushScheduler(Modem &modem)
+{
+  int kept = 0;
+  int relogged = 0;
+  for (int i = 0; i < schedCount; i++)
+  {
+    sched_msg_t *msg = &schedQueue[i];
+    int result = publishStamped(modem, msg->topic, msg->message, msg->timestamp, msg->QoS, msg->retain);
+    if (result == 1 && !relogged)
+    {
+      // The broker connection may have dropped, log in again once and retry. This resumes the
+      // TLS session when the module still holds it
+      relogged = 1;
+      if (modem.loginMQTT() == 0)
+      {
+        result = publishStamped(modem, msg->topic, msg->message, msg->timestamp, msg->QoS, msg->retain);
+      }
+    }
+    if (result == 0)
+    {
+      schedStats.sent++;
+    }
+    else if (result == 2)
+    {
+      printToConsole("Message too long to publish, dropped\n");
+      schedStats.dropped++;
+    }
+    else
+    {
+      // Logging in again did not help, keep this and all later messages for the next flush
+      schedStats.failed++;
+      for (; i < schedCount; i++)
+      {
+        if (kept != i)
+        {
+          schedQueue[kept] = schedQueue[i];
+        }
+        kept++;
+      }
+      break;
+    }
+  }
+  schedCount = kept;
+  schedLastFailed = kept > 0;
+
+  if (kept == 0)
+  {
+    schedBackoff = 0;
+    return 0;
+  }
+  schedBackoff = schedBackoff == 0 ? SCHED_RETRY_MIN : schedBackoff * 2;
+  schedBackoff = schedBackoff > SCHED_RETRY_MAX ? SCHED_RETRY_MAX : schedBackoff;
+  schedRetryAt = millis() + schedBackoff;
+  char msgToPrint[64];
+  sprintf(msgToPrint, "Publishing failed, retrying %d messages in %lu s\n", kept, schedBackoff / 1000);
+  printToConsole(msgToPrint);
+  return kept;
+}
+
+/**
+ * @brief Queues a message for publishing
+ * @param modem The module to publish with
+ * @param topic The topic to publish to. Must stay valid until the message is sent
+ * @param message The message to publish. It is copied into the queue
+ * @param QoS The QoS level to publish at
+ * @param retain Whether to retain the message
+ * @param maxDelay How long in milliseconds the message may be held back, 0 to send now
+ * @return 0 if queued or sent, 1 if sending failed, 2 if the queue is full or the message too long
+ */
+template <class Modem>
+int scheduleMessage(Modem &modem, const char *topic, const char *message, int QoS, int retain, unsigned long maxDelay)
+{
+  if (maxDelay == 0)
+  {
+    // Urgent messages go out immediately, take anything waiting along while the radio is up
+    int result = publishStamped(modem, topic, message, getTimestamp(), QoS, retain);
+    if (result == 0)
+    {
+      schedStats.sent++;
+      schedLastFailed = 0;
+      flushScheduler(modem);
+      return 0;
+    }
+    if (result == 2)
+    {
+      printToConsole("Message too long to publish, dropped\n");
+      schedStats.dropped++;
+      return 2;
+    }
+    schedStats.failed++;
+    schedLastFailed = 1;
+    return 1;
+  }
+  if (schedCount >= SCHED_QUEUE_LEN || strlen(message) >= SCHED_MSG_SIZE)
+  {
+    printToConsole("Message dropped by scheduler\n");
+    schedStats.dropped++;
+    return 2;
+  }
+  sched_msg_t *msg = &schedQueue[schedCount++];
+  msg->topic = topic;
+  strcpy(msg->message, message);
+  msg->QoS = QoS;
+  msg->retain = retain;
+  msg->timestamp = getTimestamp();
+  msg->deadline = millis() + maxDelay;
+  return 0;
+}
+
+/**
+ * @brief Decides whether queued messages should be sent now. Call this from loop()
+ * @param modem The module to publish with
+ * @return Number of messages still queued
+ */
+template <class Modem>
+int serviceScheduler(Modem &modem)
+{
+  if (schedCount == 0)
+  {
+    return 0;
+  }
+
+  // Publishing can only fail until the module is registered again
+  if (modem.registration == 0 || modem.registration == 2 || modem.registration == 3)
+  {
+    return schedCount;
+  }
+
+  unsigned long now = millis();
+  // Expired deadlines also wait for the backoff, otherwise every loop() would retry
+  if (schedBackoff && (long)(now - schedRetryAt) < 0)
+  {
+    return schedCount;
+  }
+
+  for (int i = 0; i < schedCount; i++)
+  {
+    if ((long)(now - schedQueue[i].deadline) >= 0)
+    {
+      printToConsole("Scheduler deadline expired, sending\n");
+      schedStats.expired++;
+      return flushScheduler(modem);
+    }
+  }
+
+  if (schedSampled && now - schedLastSample < SCHED_SAMPLE_INTERVAL)
+  {
+    return schedCount;
+  }
+  schedSampled = 1;
+  schedLastSample = now;
+  schedStats.samples++;
+  if (modem.getSignalQuality(&schedQuality) == 0 && schedQuality.coverage <= SCHED_MAX_COVERAGE)
+  {
+    return flushScheduler(modem);
+  }
+
+  char msgToPrint[64];
+  sprintf(msgToPrint, "Poor coverage (CE%d, %d dBm), holding %d messages\n", schedQuality.coverage, schedQuality.rsrp, schedCount);
+  printToConsole(msgToPrint);
+  schedStats.held++;
+  return schedCount;
+}
+
+#endif // NB_SCHEDULER_H
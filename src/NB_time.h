@@ -0,0 +1,121 @@
+/**
+ * @file NB_time.h
+ * @author Bergma
+ * @brief Network time service based on the module clock (AT+CCLK?)
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details initModule() enables automatic time zone update (AT+CTZU=1), so the module clock is
+ * @details set by the network on registration. Call syncNetworkTime() once after getNetwork(). The
+ * @details time is then kept as an offset against millis() and no further AT or NTP traffic is needed.
+ * @details Timestamps are 32 bit fixed point with TIME_FRAC_BITS fractional bits, counted from
+ * @details TIME_EPOCH (2022-01-01 00:00:00 UTC). With 4 fractional bits (1/16 s) they cover 8.5 years.
+ * @details The time base is kept in RTC memory; call timeBeforeSleep() before deep sleep to carry it over.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_TIME_H
+#define NB_TIME_H
+
+#include "NB_R410M.h"
+
+#define TIME_EPOCH 1640995200UL // 2022-01-01 00:00:00 UTC in Unix time
+#define TIME_FRAC_BITS 4
+
+// Defined by the program, see src/main.cpp
+extern uint32_t timeBase;            // Timestamp at timeBaseMillis, in RTC memory
+extern uint8_t timeValid;            // In RTC memory
+extern unsigned long timeBaseMillis; // millis() restarts after deep sleep, so this is not kept in RTC memory
+
+/**
+ * @brief Converts a civil UTC date to days since 1970-01-01
+ */
+inline long daysFromCivil(int year, int month, int day)
+{
+  year -= month <= 2;
+  long era = (year >= 0 ? year : year - 399) / 400;
+  long yoe = year - era * 400;
+  long doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+/**
+ * @brief Reads the module clock and sets the time base
+ * @param modem The module to read the clock of
+ * @return 0 if successful, 1 if the clock could not be read or has not been set by the network
+ */
+template <class Modem>
+int syncNetworkTime(Modem &modem)
+{
+  char command[16];
+  char ret[AT_RESPONSE_SIZE];
+  at_cclk_t clk;
+
+  sprintf(command, "%s%s", AT, SARA_CLOCK_GET);
+  modem.transmitCommand(command);
+  int len = modem.readResponse(ret, sizeof(ret), 1000);
+  if (len < 0 || parseCCLK(ret, len, &clk))
+  {
+    printToConsole("Failed to read network time\n");
+    return 1;
+  }
+  // Until the network has set the clock it counts from the module default date
+  if (clk.year < 22)
+  {
+    printToConsole("Network time not available\n");
+    return 1;
+  }
+  unsigned long millisNow = millis();
+  long days = daysFromCivil(2000 + clk.year, clk.month, clk.day);
+  // The clock is local time, tz is the offset in quarters of an hour
+  long seconds = days * 86400L + clk.hour * 3600L + clk.minute * 60L + clk.second - clk.tz * 900L;
+
+  timeBase = (uint32_t)(seconds - TIME_EPOCH) << TIME_FRAC_BITS;
+  timeBaseMillis = millisNow;
+  timeValid = 1;
+
+  char msgToPrint[48];
+  sprintf(msgToPrint, "Network time synced: %ld\n", seconds);
+  printToConsole(msgToPrint);
+  return 0;
+}
+
+/**
+ * @brief Returns the current time as a fixed point timestamp. Cheap enough to call for every sample
+ * @return Timestamp, 0 if the time has not been synced
+ */
+inline uint32_t getTimestamp()
+{
+  if (!timeValid)
+  {
+    return 0;
+  }
+  unsigned long elapsed = millis() - timeBaseMillis;
+  return timeBase + (uint32_t)(((uint64_t)elapsed << TIME_FRAC_BITS) / 1000);
+}
+
+/**
+ * @brief Converts a timestamp to Unix time in whole seconds
+ */
+inline uint32_t timestampToUnix(uint32_t timestamp)
+{
+  return (timestamp >> TIME_FRAC_BITS) + TIME_EPOCH;
+}
+
+/**
+ * @brief Moves the time base forward by the sleep time, so timestamps stay valid after deep sleep
+ * @param ms Time the ESP32 is going to sleep in milliseconds
+ */
+inline void timeBeforeSleep(unsigned long ms)
+{
+  if (timeValid)
+  {
+    // millis() starts from 0 again on wake
+    timeBase = getTimestamp() + (uint32_t)(((uint64_t)ms << TIME_FRAC_BITS) / 1000);
+  }
+}
+
+#endif // NB_TIME_H
@@ -0,0 +1,241 @@
+/**
+ * @file NB_transcript.h
+ * @author Bergma
+ * @brief Records every byte exchanged with the module, with timestamps, for replay on a host
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details TranscriptTransport wraps the real transport and logs into a RAM ring buffer. When the
+ * @details buffer is full the oldest records are dropped, so it always holds the latest exchange.
+ * @details Build with UART_TRANSCRIPT to drive lteModem through lteTranscript, and call
+ * @details lteTranscript.save() to write the buffer to SPIFFS. src/main.cpp saves the full initialization,
+ * @details a resumed session and the traffic of loop() to separate files, and clears the buffer after each
+ * @details save. tools/replay plays a transcript back against the driver.
+ * @details File format, all integers little endian:
+ * @details   header: "NBTR", version (1 byte), base time in ms (4 bytes, millis() on the device)
+ * @details   record: tag (1 byte), time since previous record in ms (varint), data
+ * @details   tag bit 7 is the direction (1 = sent to the module), bits 0-6 are the data length - 1
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef NB_TRANSCRIPT_H
+#define NB_TRANSCRIPT_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "SPIFFS.h"
+#else
+#include "NB_host.h"
+#endif
+#include <string.h>
+
+#ifndef TRANSCRIPT_SIZE
+#define TRANSCRIPT_SIZE 16384 // RAM used for the ring buffer
+#endif
+
+#define TRANSCRIPT_MAGIC "NBTR"
+#define TRANSCRIPT_VERSION 1
+#define TRANSCRIPT_TX 0x80
+#define TRANSCRIPT_MAX_RUN 128
+
+template <class Transport>
+class TranscriptTransport
+{
+public:
+  Transport &inner;
+
+  TranscriptTransport(Transport &transport) : inner(transport) { clear(); }
+
+  // Transport interface, every byte is passed through and recorded
+
+  void begin(unsigned long baud) { inner.begin(baud); }
+
+  int available() { return inner.available(); }
+
+  int read()
+  {
+    int c = inner.read();
+    if (c >= 0)
+    {
+      uint8_t b = c;
+      record(0, &b, 1);
+    }
+    return c;
+  }
+
+  size_t print(const char *text)
+  {
+    record(TRANSCRIPT_TX, (const uint8_t *)text, strlen(text));
+    return inner.print(text);
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    record(TRANSCRIPT_TX, data, size);
+    return inner.write(data, size);
+  }
+
+  /**
+   * @brief Drops all recorded data and restarts the clock
+   */
+  void clear()
+  {
+    head = 0;
+    tail = 0;
+    used = 0;
+    lastTag = -1;
+    lastMs = millis();
+    firstMs = lastMs;
+  }
+
+  /**
+   * @brief Number of bytes of record data in the ring buffer
+   */
+  int size() const { return used; }
+
+  /**
+   * @brief Copies the transcript, including the file header, into buf
+   * @param buf Destination, must hold at least size() + 9 bytes
+   * @return Number of bytes written
+   */
+  int serialize(uint8_t *buf) const
+  {
+    serializeHeader(buf);
+    for (int i = 0; i < used; i++)
+    {
+      buf[9 + i] = at(i);
+    }
+    return used + 9;
+  }
+
+#ifdef ARDUINO
+  /**
+   * @brief Writes the transcript to a file on SPIFFS
+   * @param filename Name of the file, it is overwritten
+   * @return 0 if successful, 1 if not
+   */
+  int save(const char *filename)
+  {
+    if (!SPIFFS.begin(false))
+    {
+      return 1;
+    }
+    File file = SPIFFS.open(filename, "w");
+    if (!file)
+    {
+      return 1;
+    }
+    uint8_t header[9];
+    // Write the header, then the ring in at most two pieces to avoid a second buffer
+    serializeHeader(header);
+    int ok = file.write(header, sizeof(header)) == sizeof(header);
+    int first = used < TRANSCRIPT_SIZE - tail ? used : TRANSCRIPT_SIZE - tail;
+    ok = ok && file.write(ring + tail, first) == (size_t)first;
+    ok = ok && (used == first || file.write(ring, used - first) == (size_t)(used - first));
+    file.close();
+    return ok ? 0 : 1;
+  }
+#endif // ARDUINO
+
+protected:
+  uint8_t ring[TRANSCRIPT_SIZE];
+  int head;            // Next byte to write
+  int tail;            // First byte of the oldest record
+  int used;            // Bytes between tail and head
+  int lastTag;         // Position of the tag of the newest record, -1 if it can not be extended
+  unsigned long lastMs;  // Time of the newest record
+  unsigned long firstMs; // Base time the delta of the oldest record is relative to
+
+  void serializeHeader(uint8_t *buf) const
+  {
+    memcpy(buf, TRANSCRIPT_MAGIC, 4);
+    buf[4] = TRANSCRIPT_VERSION;
+    for (int i = 0; i < 4; i++)
+    {
+      buf[5 + i] = (firstMs >> (8 * i)) & 0xFF;
+    }
+  }
+
+  uint8_t at(int offset) const { return ring[(tail + offset) % TRANSCRIPT_SIZE]; }
+
+  /**
+   * @brief Drops the oldest record and moves its time into the base time
+   */
+  void dropOldest()
+  {
+    int tag = ring[tail];
+    int pos = 1;
+    unsigned long delta = 0;
+    int shift = 0;
+    uint8_t b;
+    do
+    {
+      b = at(pos++);
+      delta |= (unsigned long)(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    int length = pos + (tag & 0x7F) + 1;
+    if (lastTag == tail)
+    {
+      lastTag = -1;
+    }
+    tail = (tail + length) % TRANSCRIPT_SIZE;
+    used -= length;
+    // The next record's delta is relative to the dropped one, so that becomes the base time
+    firstMs += delta;
+  }
+
+  void put(uint8_t b)
+  {
+    ring[head] = b;
+    head = (head + 1) % TRANSCRIPT_SIZE;
+    used++;
+  }
+
+  void makeRoom(int bytes)
+  {
+    while (used > 0 && TRANSCRIPT_SIZE - used < bytes)
+    {
+      dropOldest();
+    }
+  }
+
+  void record(uint8_t direction, const uint8_t *data, size_t size)
+  {
+    unsigned long now = millis();
+    while (size > 0)
+    {
+      // Extend the newest record if it has the same direction and time and is not full
+      if (lastTag >= 0 && now == lastMs && (ring[lastTag] & TRANSCRIPT_TX) == direction &&
+          (ring[lastTag] & 0x7F) < TRANSCRIPT_MAX_RUN - 1)
+      {
+        makeRoom(1);
+        if (lastTag >= 0)
+        {
+          ring[lastTag]++;
+          put(*data++);
+          size--;
+          continue;
+        }
+      }
+      // Start a new record: tag, varint delta, first byte
+      unsigned long delta = now - lastMs;
+      makeRoom(1 + 5 + 1);
+      lastTag = head;
+      put(direction);
+      do
+      {
+        uint8_t b = delta & 0x7F;
+        delta >>= 7;
+        put(delta ? b | 0x80 : b);
+      } while (delta);
+      put(*data++);
+      size--;
+      lastMs = now;
+    }
+  }
+};
+
+#endif // NB_TRANSCRIPT_H
@@ -2,10 +2,33 @@
 
 #include "AT_commands.h"
 #include "NB_R410M.h"
+#include "NB_connect.h"
+#include "NB_scheduler.h"
+#include "NB_resume.h"
+#include "NB_time.h"
+#ifdef SAS_AUTH
+#include "NB_sas.h"
+#endif
+#ifdef MEMORY_CHECK
+#include "NB_memory.h"
+#endif
+#ifdef NETSTATUS_PIN
+#include "NB_netstatus.h"
+#endif
+#ifdef EMBED_CERTS
+#include "certs.h" // Generated by scripts/embed_certs.py
+#endif
+#ifdef UART_TRANSCRIPT
+#include "NB_transcript.h"
+#endif
+#ifdef MQTT_SOCKET
+#include "NB_mqtt_socket.h"
+#endif
 
 
 
 #define SerialMonitor Serial
+#define LTEShieldSerial lteSerial
 #define CA_FILE "/MS.der"
 #define CERT_FILE "/nb1_cert.der"
 #define KEY_FILE "/nb1_key.der"
@@ -14,12 +37,30 @@
 #define CERT_NAME "cert"
 #define KEY_NAME "key"
 #define SEC_PROFILE 2
+#define TRANSCRIPT_FILE "/transcript.bin"               // Full initialization
+#define TRANSCRIPT_RESUME_FILE "/transcript_resume.bin" // Session resumed after deep sleep
+#define TRANSCRIPT_LOOP_FILE "/transcript_loop.bin"     // Latest traffic of loop()
+
+// Time between saves of the loop() transcript when built with UART_TRANSCRIPT. Every save rewrites the file
+#define TRANSCRIPT_SAVE_INTERVAL 600000
+
+// How long telemetry may be held back while waiting for better coverage
+#define MSG_MAX_DELAY 300000
+
+// Time between heap and stack reports when built with MEMORY_CHECK
+#define MEMORY_REPORT_INTERVAL 60000
+
+// How long to wait for the network status pin to show registration before polling with AT+CEREG?
+#define NETWORK_WAIT_TIMEOUT 180000
+// Longest sleep in loop() while the module is not registered
+#define NETWORK_IDLE_WAIT 10000
 
 const struct connection_info_t
 {
   const char *HostName = "NBIoTLS.azure-devices.net";
   const char *identity = "nb1";
   const char *username = "NBIoTLS.azure-devices.net/nb1/?api-version=2021-04-12";
+  const char *resourceUri = "NBIoTLS.azure-devices.net/devices/nb1";
   const char *topic = "devices/nb1/messages/events/";
   const char *subTopic = "devices/nb1/messages/devicebound/#";
   const char *SharedAccessKeyName = "iothubowner";
@@ -27,6 +68,17 @@ const struct connection_info_t
   const int Port = 8883;
 } connection_info;
 
+// Broker connection set up by configureConnection()
+const connect_config_t connect_config = {
+    connection_info.HostName, connection_info.Port, connection_info.identity, connection_info.topic,
+    "Unintented disconnect", 60, SEC_PROFILE, CA_NAME,
+#ifdef SAS_AUTH
+    NULL, NULL, // Logs in with a SAS token instead of the client certificate
+#else
+    CERT_NAME, KEY_NAME,
+#endif
+    1, 1};
+
 #define POWERPIN 33
 
 // APN -- Access Point Name. Gateway between GPRS MNO
@@ -34,23 +86,154 @@ const char APN[] = "lpwa.telia.iot";
 
 #define DEBUG_PASSTHROUGH_ENABLED
 
+#if defined(MQTT_SOCKET) || defined(UART_TRANSCRIPT)
+// The passthrough in loop() reads the module directly. It would take the socket data and URCs the MQTT
+// client waits for, and the bytes would be missing from the transcript
+#undef DEBUG_PASSTHROUGH_ENABLED
+#endif
+
+// Uncomment to log in with a SAS token instead of the client certificate. TLS then only authenticates
+// the server, which makes the handshake smaller, and the client certificate and key are not imported
+//#define SAS_AUTH
+
+// Uncomment when GPIO16 of the module is wired to this ESP32 pin (through a level shifter, it is 1.8 V).
+// Registration is then read from the pin by interrupt instead of polling the module
+//#define NETSTATUS_PIN 32
+
+// Uncomment to deep sleep between reports. The module stays powered and the session is resumed on wake
+//#define DEEP_SLEEP_INTERVAL 300000
+
 /*
 
 
 */
+HardwareSerial lteSerial(2);
+
+/**
+ * @brief Use this function for your own port of UART print to console
+ * @param text Text to print
+ */
+void printToConsole(const char *text)
+{
+  SerialMonitor.print(text);
+}
+
+#ifdef UART_TRANSCRIPT
+// Records all traffic with the module, see NB_transcript.h
+TranscriptTransport<HardwareSerial> lteTranscript(LTEShieldSerial);
+typedef TranscriptTransport<HardwareSerial> lte_transport_t;
+#define LTE_TRANSPORT lteTranscript
+#else
+typedef HardwareSerial lte_transport_t;
+#define LTE_TRANSPORT LTEShieldSerial
+#endif
+
+// The module on the LTE shield
+#ifdef MQTT_SOCKET
+NB_R410M_socket<lte_transport_t> lteModem(LTE_TRANSPORT);
+#else
+NB_R410M<lte_transport_t> lteModem(LTE_TRANSPORT);
+#endif
+
+// State of the helpers, declared in their headers
+
+// NB_time.h
+RTC_DATA_ATTR uint32_t timeBase = 0;
+RTC_DATA_ATTR uint8_t timeValid = 0;
+unsigned long timeBaseMillis = 0;
+
+// NB_scheduler.h
+sched_msg_t schedQueue[SCHED_QUEUE_LEN];
+int schedCount = 0;
+unsigned long schedLastSample = 0;
+int schedSampled = 0;
+signal_quality_t schedQuality = {0, 0, 0, -1};
+unsigned long schedBackoff = 0;
+unsigned long schedRetryAt = 0;
+int schedLastFailed = 0;
+sched_stats_t schedStats = {0, 0, 0, 0, 0, 0};
+
+// NB_resume.h
+RTC_DATA_ATTR session_state_t sessionState;
+
+#ifdef SAS_AUTH
+// NB_sas.h
+RTC_DATA_ATTR char sasToken[SAS_TOKEN_SIZE];
+RTC_DATA_ATTR uint32_t sasExpiry = 0;
+const char *sasUri = NULL;
+const char *sasKey = NULL;
+const char *sasKeyName = NULL;
+const char *sasUsername = NULL;
+unsigned long sasRetryAt = 0;
+int sasFailed = 0;
+#endif
+
+#ifdef NETSTATUS_PIN
+// NB_netstatus.h
+int netStatusPin = -1;
+TaskHandle_t netStatusTask = NULL;
+portMUX_TYPE netStatusMux = portMUX_INITIALIZER_UNLOCKED;
+volatile unsigned long netLastEdge = 0;
+volatile unsigned long netLastRise = 0;
+volatile uint8_t netLevel = 0;
+volatile uint8_t netDouble = 0;
+int netState = NETSTATUS_UNKNOWN;
+unsigned long netStatusChanges = 0;
+#endif
+
 char *IP = NULL;
+unsigned long memoryReported = 0;
+unsigned long transcriptSaved = 0;
+
+#ifdef UART_TRANSCRIPT
+/**
+ * @brief Saves the UART transcript for replay with tools/replay and starts a new one
+ * @param filename File on SPIFFS, it is overwritten
+ */
+void saveTranscript(const char *filename)
+{
+  if (lteTranscript.save(filename))
+  {
+    SerialMonitor.printf("Failed to save UART transcript %s\n", filename);
+  }
+  lteTranscript.clear();
+  transcriptSaved = millis();
+}
+#endif
 
-void setup()
+/**
+ * @brief Hash of everything that is configured in the module by initConnection()
+ * @return Configuration hash stored with the session in RTC memory
+ */
+uint32_t sessionProfile()
 {
-  SerialMonitor.begin(9600);
-  while (!SerialMonitor)
-    ; // For boards with built-in USB
+  char numbers[16];
+  sprintf(numbers, "%d,%d", connection_info.Port, SEC_PROFILE);
+#ifdef SAS_AUTH
+  const char *config[] = {APN, connection_info.HostName, connection_info.identity, connection_info.topic,
+                          CA_NAME, connection_info.username, numbers};
+#else
+  const char *config[] = {APN, connection_info.HostName, connection_info.identity, connection_info.topic,
+                          CA_NAME, CERT_NAME, KEY_NAME, numbers};
+#endif
+  return hashConfig(config, sizeof(config) / sizeof(config[0]));
+}
 
+/**
+ * @brief Power cycles and fully initializes the module, network, certificates and MQTT
+ * @param steps Set to the steps that succeeded, for saveSession()
+ * @return 0 if logged in to the MQTT broker, 1 if not
+ */
+int initConnection(session_steps_t *steps)
+{
+  memset(steps, 0, sizeof(*steps));
+#ifndef EMBED_CERTS
   if (!SPIFFS.begin(true))
   {
     Serial.println("An Error has occurred while mounting SPIFFS");
-    return;
+    return 1;
   }
+#endif
 
   SerialMonitor.println(F("Initializing the LTE Shield..."));
   SerialMonitor.println(F("...this may take ~25 seconds if the shield is off."));
@@ -64,7 +247,7 @@ void setup()
   pinMode(POWERPIN, INPUT); // Return to high-impedance, rely on SARA module internal pull-up
   delay(1000);
   // Initialize the LTE Shield and enable AT interface and Timezone update
-  if (initModule(30000))
+  if (lteModem.initModule(30000))
   {
     SerialMonitor.println(F("Failed to initialize the LTE Shield!"));
     while (1)
@@ -83,13 +266,25 @@ void setup()
   }
 
   // Set the operator APN
-  setAPN(APN);
+  steps->initDone = lteModem.setAPN(APN) == 0;
 
   // Get status of network aquisition
-  getNetwork();
+#ifdef NETSTATUS_PIN
+  // Sleep until the status pin shows registration, poll only if it does not within the timeout
+  if (netStatusWait(lteModem, NETWORK_WAIT_TIMEOUT))
+  {
+    lteModem.getNetwork();
+  }
+#else
+  lteModem.getNetwork();
+#endif
+  steps->registered = lteModem.registration == 1 || lteModem.registration == 5;
+
+  // Read the time the network set on registration
+  syncNetworkTime(lteModem);
 
   // Get IP address
-  IP = printInfo();
+  IP = lteModem.printInfo();
   if (IP != NULL)
   {
     SerialMonitor.printf("IP: %s\n", IP);
@@ -99,52 +294,128 @@ void setup()
     SerialMonitor.printf("IP: NULL\n");
   }
 
+  int certResult = 0;
+#ifdef EMBED_CERTS
+  // Import certificates from flash, SPIFFS is only mounted if this fails
+  certResult |= lteModem.importCertMQTT(CA_DER, sizeof(CA_DER), CA_FILE, 0, CA_NAME);
+#ifndef SAS_AUTH
+  certResult |= lteModem.importCertMQTT(CERT_DER, sizeof(CERT_DER), CERT_FILE, 1, CERT_NAME);
+  certResult |= lteModem.importCertMQTT(KEY_DER, sizeof(KEY_DER), KEY_FILE, 2, KEY_NAME);
+#endif
+#else
   // Import CA certificate
-  loadCertMQTT(CA_FILE, 0, CA_NAME);
+  certResult |= lteModem.loadCertMQTT(CA_FILE, 0, CA_NAME);
 
+#ifndef SAS_AUTH
   // Import client certificate
-  loadCertMQTT(CERT_FILE, 1, CERT_NAME);
+  certResult |= lteModem.loadCertMQTT(CERT_FILE, 1, CERT_NAME);
 
   // import client private key
-  loadCertMQTT(KEY_FILE, 2, KEY_NAME);
-
-
-  // Assign the certificates to a security profile
-  assignCert(SEC_PROFILE, connection_info.HostName, 4);
-  assignCert(SEC_PROFILE, CA_NAME, 3);
-  assignCert(SEC_PROFILE, CERT_NAME, 5);
-  assignCert(SEC_PROFILE, KEY_NAME, 6);
+  certResult |= lteModem.loadCertMQTT(KEY_FILE, 2, KEY_NAME);
+#endif
+#endif
 
-  // Set the security profile to be used by MQTT
-  enableSSL(SEC_PROFILE);
+#ifdef SAS_AUTH
+  // Set the username and a SAS token as password. Not batched, it may have to read the clock first
+  sasLogin(lteModem);
+#endif
 
-  // Set MQTT ID
-  setMQTTid(connection_info.identity);
+  // Security profile and MQTT client, the same sequence as tools/fleet_sim and tools/replay
+  certResult |= configureConnection(lteModem, &connect_config);
+  steps->certsLoaded = certResult == 0;
 
-  // Set broker hostname and port
-  setMQTT(connection_info.HostName, connection_info.Port);
+  // Login to MQTT broker
+  int result = lteModem.loginMQTT();
+  steps->mqttLoggedIn = result == 0;
+  return result;
+}
 
-  // Set Last Will topic
-  willconfigMQTT(connection_info.topic);
+void setup()
+{
+  SerialMonitor.begin(9600);
+  while (!SerialMonitor)
+    ; // For boards with built-in USB
 
-  // Set Last Will message
-  willmsgMQTT("Unintented disconnect");
+#ifdef SAS_AUTH
+  sasConfigure(connection_info.resourceUri, connection_info.SharedAccessKey, connection_info.SharedAccessKeyName,
+               connection_info.username);
+#endif
 
-  // Enable MQTT keepalive
-  setMQTTping(60);
-  enableMQTTkeepalive();
+#ifdef NETSTATUS_PIN
+  netStatusBegin(NETSTATUS_PIN);
+#endif
 
-  // Login to MQTT broker
-  loginMQTT();
+  uint32_t profile = sessionProfile();
+  // After deep sleep the module usually still holds the session, skip straight to publishing
+  if (resumeSession(lteModem, profile) == 0)
+  {
+    IP = lteModem.ip;
+#ifdef UART_TRANSCRIPT
+    // A separate file, so a resume does not overwrite the recording of the full initialization
+    saveTranscript(TRANSCRIPT_RESUME_FILE);
+#endif
+  }
+  else
+  {
+    session_steps_t steps;
+    initConnection(&steps);
+    saveSession(lteModem, profile, IP, &steps);
+#ifdef UART_TRANSCRIPT
+    // Keep the exchange with the module for replay with tools/replay
+    saveTranscript(TRANSCRIPT_FILE);
+#endif
+  }
 
   char msg[] = "Hello World from NB_IoT module!";
-  // Publish message to MQTT broker
-  publishMessage(connection_info.topic, msg, 0, 0);
+  // Queue message for the MQTT broker, it is sent once coverage allows
+  scheduleMessage(lteModem, connection_info.topic, msg, 0, 0, MSG_MAX_DELAY);
+
+#ifdef MEMORY_CHECK
+  memoryCheckpoint("setup");
+  // From here on everything must run from static buffers, with MEMORY_STRICT an allocation aborts
+  memoryLock();
+  memoryReported = millis();
+#endif
 }
 
 void loop()
 {
-  
+#ifdef NETSTATUS_PIN
+  // Nothing can be sent without registration, sleep until the status pin shows the network again
+  if (!netStatusRegistered(netStatusUpdate(lteModem)))
+  {
+    netStatusWait(lteModem, NETWORK_IDLE_WAIT);
+  }
+#endif
+
+  // Keepalive of the MQTT connection when it is run on the ESP32
+  lteModem.pollMQTT();
+
+#ifdef SAS_AUTH
+  // Log in with a new token before the current one expires
+  serviceSasToken(lteModem);
+#endif
+
+  // Publish queued messages when coverage is good or their deadline has passed
+#ifdef DEEP_SLEEP_INTERVAL
+  if (serviceScheduler(lteModem) == 0)
+  {
+    // Make the next wake run the full initialization if the last publish failed. Failures that a later
+    // attempt or the relogin recovered from do not mean the session is broken
+    if (schedLastFailed)
+    {
+      invalidateSession();
+    }
+    timeBeforeSleep(DEEP_SLEEP_INTERVAL);
+#ifdef UART_TRANSCRIPT
+    saveTranscript(TRANSCRIPT_LOOP_FILE);
+#endif
+    sleepFor(lteModem, DEEP_SLEEP_INTERVAL);
+  }
+#else
+  serviceScheduler(lteModem);
+#endif
+
 #ifdef DEBUG_PASSTHROUGH_ENABLED
   if (LTEShieldSerial.available())
   {
@@ -158,4 +429,18 @@ void loop()
   }
 #endif
 
+#ifdef UART_TRANSCRIPT
+  if (millis() - transcriptSaved >= TRANSCRIPT_SAVE_INTERVAL)
+  {
+    saveTranscript(TRANSCRIPT_LOOP_FILE);
+  }
+#endif
+
+#ifdef MEMORY_CHECK
+  if (millis() - memoryReported >= MEMORY_REPORT_INTERVAL)
+  {
+    memoryCheckpoint("loop");
+    memoryReported = millis();
+  }
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,568 @@
+/**
+ * @file bench.cpp
+ * @author Bergma
+ * @brief Host microbenchmarks of the driver's hot paths, for tracking CPU cost per byte and per command
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Every benchmark drives an NB_R410M<BenchTransport>. The transport answers each command from
+ * @details memory, so only the CPU time of the driver is measured: response matching in getResponse(),
+ * @details command formatting in publishMessage() and assignCert(), response parsing in printInfo() and
+ * @details getNetwork(), the certificate transfer in setCertMQTT() and the uplink compression in
+ * @details compressPayload(). Payload sizes are swept.
+ * @details Each benchmark runs until it has used --min-ms of CPU time. Results are printed as a table, or
+ * @details with --json in the layout of Google Benchmark, so existing tooling can compare runs.
+ * @details Built with MEMORY_CHECK, the malloc() calls made by the driver during the measured iterations are
+ * @details counted (allocs_per_iter, as the memory manager of Google Benchmark reports it). With --no-alloc
+ * @details the run fails if any benchmark allocates, the hot paths must work from the instance buffers.
+ * @details Build with PlatformIO (pio run -e bench) or directly:
+ * @details   g++ -std=c++11 -O2 -Isrc -DMEMORY_CHECK tools/bench/bench.cpp src/NB_memory.cpp -o bench \
+ * @details     -Wl,--wrap=malloc -Wl,--wrap=free -Wl,--wrap=calloc -Wl,--wrap=realloc
+ * @details Example, keep the results of the parsing benchmarks:
+ * @details   ./bench --filter Response --json > bench.json
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "NB_R410M.h"
+#include "NB_compress.h"
+#include "NB_memory.h"
+
+std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void delay(unsigned long)
+{
+  // Only CPU time is measured, e.g. the 500 ms poll interval of getNetwork() is skipped
+}
+
+void printToConsole(const char *)
+{
+}
+
+/**
+ * @brief Transport that answers every command or data block with the next canned reply
+ */
+class BenchTransport
+{
+public:
+  std::vector<std::string> replies;
+
+  BenchTransport() : next(0), pos(0) {}
+
+  void reset(const char *reply)
+  {
+    replies.clear();
+    replies.push_back(reply);
+    next = 0;
+    rx.clear();
+    pos = 0;
+  }
+
+  /**
+   * @brief Makes bytes available without a command, for calling getResponse() directly
+   */
+  void preload(const std::string &data)
+  {
+    rx = data;
+    pos = 0;
+  }
+
+  void begin(unsigned long) {}
+
+  int available() { return pos < rx.size(); }
+
+  int read() { return pos < rx.size() ? (unsigned char)rx[pos++] : -1; }
+
+  size_t print(const char *text)
+  {
+    size_t len = strlen(text);
+    if (len > 0 && text[len - 1] == '\r')
+    {
+      reply();
+    }
+    return len;
+  }
+
+  size_t write(const uint8_t *, size_t size)
+  {
+    reply();
+    return size;
+  }
+
+private:
+  size_t next;
+  std::string rx;
+  size_t pos;
+
+  void reply()
+  {
+    if (!replies.empty())
+    {
+      preload(replies[next]);
+      next = (next + 1) % replies.size();
+    }
+  }
+};
+
+/**
+ * @brief Handed to every benchmark. It runs the measured code iterations times and reports the work done
+ */
+typedef struct
+{
+  long iterations;
+  int arg;           // Payload size of this run
+  double bytes;      // Bytes processed per iteration, for the per byte cost
+  double items;      // Commands per iteration, for the per command cost
+  const char *error; // Set if the driver did not return the expected result
+} bench_state_t;
+
+typedef void (*bench_fn_t)(bench_state_t &state);
+
+typedef struct
+{
+  const char *name;
+  bench_fn_t fn;
+  std::vector<int> args;
+} bench_t;
+
+BenchTransport transport;
+NB_R410M<BenchTransport> modem(transport);
+
+const char TOPIC[] = "devices/nb1/messages/events/";
+
+/**
+ * @brief A response of the given size with the expected line at the end, as after URCs or echo
+ */
+std::string filledResponse(int size, const char *expected)
+{
+  std::string text;
+  while ((int)text.size() < size)
+  {
+    text += "\r\n+CSCON: 1\r\n\r\n+UUPSDA: 0,\"10.160.33.178\"\r\n";
+  }
+  text.resize(size);
+  text += "\r\n";
+  text += expected;
+  text += "\r\n";
+  return text;
+}
+
+void BM_getResponse(bench_state_t &state)
+{
+  std::string data = filledResponse(state.arg, "OK");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    transport.preload(data);
+    if (!modem.getResponse("OK", 1000))
+    {
+      state.error = "expected response not found";
+      return;
+    }
+  }
+  state.bytes = data.size();
+  state.items = 1;
+}
+
+void BM_readResponse(bench_state_t &state)
+{
+  std::string data = filledResponse(state.arg, "OK");
+  char buf[2048];
+  for (long i = 0; i < state.iterations; i++)
+  {
+    transport.preload(data);
+    if (modem.readResponse(buf, sizeof(buf), 1000) < 0)
+    {
+      state.error = "no OK";
+      return;
+    }
+  }
+  state.bytes = data.size();
+  state.items = 1;
+}
+
+void BM_publishMessage(bench_state_t &state)
+{
+  std::string message(state.arg, 'x');
+  transport.reset("\r\n+UMQTTC: 2,1\r\n\r\nOK\r\n");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (modem.publishMessage(TOPIC, message.c_str(), 0, 0))
+    {
+      state.error = "publish failed";
+      return;
+    }
+  }
+  state.bytes = strlen(TOPIC) + message.size();
+  state.items = 1;
+}
+
+void BM_assignCert(bench_state_t &state)
+{
+  transport.reset("\r\nOK\r\n");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (modem.assignCert(2, "NBIoTLS.azure-devices.net", 4))
+    {
+      state.error = "assign failed";
+      return;
+    }
+  }
+  state.items = 1;
+}
+
+void BM_printInfo(bench_state_t &state)
+{
+  transport.reset("\r\n+CGDCONT: 1,\"IP\",\"lpwa.telia.iot\",\"10.160.33.178\",0,0,0,0\r\n\r\nOK\r\n");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (modem.printInfo() == NULL)
+    {
+      state.error = "no IP";
+      return;
+    }
+  }
+  state.items = 1;
+}
+
+void BM_getNetwork(bench_state_t &state)
+{
+  transport.reset("\r\n+CEREG: 2,1,\"1A2B\",\"01C2D3E4\",7\r\n\r\nOK\r\n");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    modem.getNetwork();
+  }
+  if (modem.registration != 1)
+  {
+    state.error = "not registered";
+  }
+  state.items = 1;
+}
+
+void BM_parseCEREG(bench_state_t &state)
+{
+  // Parser alone, behind URCs of the given size
+  std::string data = filledResponse(state.arg, "+CEREG: 2,5,\"1A2B\",\"01C2D3E4\",7");
+  at_cereg_t cereg;
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (parseCEREG(data.c_str(), data.size(), &cereg))
+    {
+      state.error = "parse failed";
+      return;
+    }
+  }
+  state.bytes = data.size();
+  state.items = 1;
+}
+
+void BM_setCertMQTT(bench_state_t &state)
+{
+  std::vector<uint8_t> cert(state.arg, 0x30);
+  transport.reset(">");
+  transport.replies.push_back("\r\n+USECMNG: 0,0,\"ca\",\"0\"\r\n\r\nOK\r\n");
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (modem.setCertMQTT(&cert[0], cert.size(), 0, "ca"))
+    {
+      state.error = "import failed";
+      return;
+    }
+  }
+  state.bytes = cert.size();
+  state.items = 1;
+}
+
+void BM_compressPayload(bench_state_t &state)
+{
+  // Telemetry as in tools/compress/samples.txt, repeated to the given size
+  std::string message;
+  while ((int)message.size() < state.arg)
+  {
+    message += "0a41b2c3|{\"device\":\"nb1\",\"seq\":112,\"temp\":21.7,\"hum\":44.0,\"bat\":3.81,\"rsrp\":-97}";
+  }
+  message.resize(state.arg);
+  std::vector<uint8_t> frame(COMPRESS_BOUND(message.size()));
+  for (long i = 0; i < state.iterations; i++)
+  {
+    if (compressPayload((const uint8_t *)message.data(), message.size(), &frame[0], frame.size()) < 0)
+    {
+      state.error = "compress failed";
+      return;
+    }
+  }
+  state.bytes = message.size();
+  state.items = 1;
+}
+
+std::vector<int> sizes(int first, int last)
+{
+  std::vector<int> args;
+  for (int size = first; size <= last; size *= 4)
+  {
+    args.push_back(size);
+  }
+  return args;
+}
+
+/**
+ * @brief CPU time of this process in ns
+ */
+double cpuNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double wallNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+typedef struct
+{
+  std::string name;
+  long iterations;
+  double realNs; // Per iteration
+  double cpuNs;  // Per iteration
+  double bytes;
+  double items;
+  double allocs; // Per iteration, malloc() calls counted with MEMORY_CHECK
+  const char *error;
+} bench_result_t;
+
+/**
+ * @brief Name of one run, the payload size is appended as in Google Benchmark
+ */
+std::string benchName(const bench_t &bench, int arg)
+{
+  char name[96];
+  if (bench.args.empty())
+  {
+    snprintf(name, sizeof(name), "%s", bench.name);
+  }
+  else
+  {
+    snprintf(name, sizeof(name), "%s/%d", bench.name, arg);
+  }
+  return name;
+}
+
+/**
+ * @brief Runs a benchmark with growing iteration counts until it has used minMs of CPU time
+ */
+bench_result_t runBenchmark(const bench_t &bench, int arg, double minMs)
+{
+  bench_result_t result;
+  result.name = benchName(bench, arg);
+
+  bench_state_t state;
+  long iterations = 1;
+  while (1)
+  {
+    state.iterations = iterations;
+    state.arg = arg;
+    state.bytes = 0;
+    state.items = 0;
+    state.error = NULL;
+    unsigned long allocs = memStats.allocs;
+    double cpu = cpuNs();
+    double wall = wallNs();
+    bench.fn(state);
+    cpu = cpuNs() - cpu;
+    wall = wallNs() - wall;
+    allocs = memStats.allocs - allocs;
+    if (state.error != NULL || cpu >= minMs * 1e6 || wall >= minMs * 1e7 || iterations >= 1000000000L)
+    {
+      result.iterations = iterations;
+      result.realNs = wall / iterations;
+      result.cpuNs = cpu / iterations;
+      result.bytes = state.bytes;
+      result.items = state.items;
+      result.allocs = (double)allocs / iterations;
+      result.error = state.error;
+      return result;
+    }
+    // Aim a bit past the minimum time, but grow at most 10x per round
+    double factor = cpu > 0 ? minMs * 1e6 * 1.4 / cpu : 10;
+    iterations = (long)(iterations * (factor > 10 ? 10 : factor < 2 ? 2 : factor));
+  }
+}
+
+void printJson(const std::vector<bench_result_t> &results)
+{
+  time_t now = time(NULL);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+  printf("{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"bench\",\n"
+         "    \"at_response_size\": %d,\n    \"at_command_size\": %d\n  },\n  \"benchmarks\": [\n",
+         date, AT_RESPONSE_SIZE, AT_COMMAND_SIZE);
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const bench_result_t &r = results[i];
+    printf("    {\n      \"name\": \"%s\",\n      \"run_type\": \"iteration\",\n      \"iterations\": %ld,\n"
+           "      \"real_time\": %.2f,\n      \"cpu_time\": %.2f,\n      \"time_unit\": \"ns\"",
+           r.name.c_str(), r.iterations, r.realNs, r.cpuNs);
+    if (r.bytes > 0)
+    {
+      printf(",\n      \"bytes_per_second\": %.0f,\n      \"cpu_ns_per_byte\": %.3f", r.bytes * 1e9 / r.cpuNs,
+             r.cpuNs / r.bytes);
+    }
+    if (r.items > 0)
+    {
+      printf(",\n      \"items_per_second\": %.0f", r.items * 1e9 / r.cpuNs);
+    }
+#ifdef MEMORY_CHECK
+    printf(",\n      \"allocs_per_iter\": %.3f", r.allocs);
+#endif
+    if (r.error != NULL)
+    {
+      printf(",\n      \"error_occurred\": true,\n      \"error_message\": \"%s\"", r.error);
+    }
+    printf("\n    }%s\n", i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+void printTable(const std::vector<bench_result_t> &results)
+{
+  printf("%-28s %12s %12s %12s %12s %12s\n", "benchmark", "cpu ns", "ns/byte", "MB/s", "iterations", "allocs/iter");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const bench_result_t &r = results[i];
+    if (r.error != NULL)
+    {
+      printf("%-28s ERROR: %s\n", r.name.c_str(), r.error);
+      continue;
+    }
+    char perByte[16] = "-";
+    char rate[16] = "-";
+    if (r.bytes > 0)
+    {
+      snprintf(perByte, sizeof(perByte), "%.3f", r.cpuNs / r.bytes);
+      snprintf(rate, sizeof(rate), "%.1f", r.bytes * 1e3 / r.cpuNs);
+    }
+    char allocs[16] = "-";
+#ifdef MEMORY_CHECK
+    snprintf(allocs, sizeof(allocs), "%.3f", r.allocs);
+#endif
+    printf("%-28s %12.1f %12s %12s %12ld %12s\n", r.name.c_str(), r.cpuNs, perByte, rate, r.iterations, allocs);
+  }
+}
+
+void usage()
+{
+  printf("bench [options]\n"
+         "  --filter TEXT   only run benchmarks whose name contains TEXT\n"
+         "  --min-ms MS     CPU time to spend on each benchmark (200)\n"
+         "  --json          print the results as JSON\n"
+         "  --no-alloc      fail if a benchmark calls malloc(), needs a MEMORY_CHECK build\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *filter = NULL;
+  double minMs = 200;
+  int json = 0;
+  int noAlloc = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--json") == 0)
+    {
+      json = 1;
+    }
+    else if (strcmp(arg, "--no-alloc") == 0)
+    {
+      noAlloc = 1;
+    }
+    else if (strcmp(arg, "--filter") == 0 && value != NULL)
+    {
+      filter = value, i++;
+    }
+    else if (strcmp(arg, "--min-ms") == 0 && value != NULL)
+    {
+      minMs = atof(value), i++;
+    }
+    else
+    {
+      usage();
+      return 1;
+    }
+  }
+
+  // Response and command sizes are limited by AT_RESPONSE_SIZE and AT_COMMAND_SIZE
+  const bench_t benchmarks[] = {
+      {"getResponse", BM_getResponse, sizes(16, 1024)},
+      {"readResponse", BM_readResponse, sizes(16, 1024)},
+      {"publishMessage", BM_publishMessage, sizes(16, 256)},
+      {"assignCert", BM_assignCert, std::vector<int>()},
+      {"printInfo", BM_printInfo, std::vector<int>()},
+      {"getNetwork", BM_getNetwork, std::vector<int>()},
+      {"parseCEREG", BM_parseCEREG, sizes(16, 1024)},
+      {"setCertMQTT", BM_setCertMQTT, sizes(256, 4096)},
+      {"compressPayload", BM_compressPayload, sizes(16, 256)},
+  };
+
+  std::vector<bench_result_t> results;
+  for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+  {
+    const bench_t &bench = benchmarks[i];
+    std::vector<int> args = bench.args.empty() ? std::vector<int>(1, 0) : bench.args;
+    for (size_t j = 0; j < args.size(); j++)
+    {
+      if (filter != NULL && strstr(benchName(bench, args[j]).c_str(), filter) == NULL)
+      {
+        continue;
+      }
+      results.push_back(runBenchmark(bench, args[j], minMs));
+    }
+  }
+
+  if (json)
+  {
+    printJson(results);
+  }
+  else
+  {
+    printTable(results);
+  }
+#ifndef MEMORY_CHECK
+  if (noAlloc)
+  {
+    fprintf(stderr, "--no-alloc needs a build with MEMORY_CHECK\n");
+    return 1;
+  }
+#endif
+  int status = 0;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    if (results[i].error != NULL)
+    {
+      status = 1;
+    }
+    if (noAlloc && results[i].allocs > 0)
+    {
+      fprintf(stderr, "%s allocates %.3f times per iteration\n", results[i].name.c_str(), results[i].allocs);
+      status = 1;
+    }
+  }
+  return status;
+}
@@ -0,0 +1,160 @@
+"""
+Backend decoder for payloads compressed by src/NB_compress.h.
+
+Frames start with FRAME_MAGIC and the version of the dictionary they were
+compressed with, followed by tokens:
+  0x00-0x7f  literal run, the control byte + 1 bytes that follow are copied
+  0x80-0xff  match of ((c >> 3) & 0x0f) + 3 bytes, at distance ((c & 7) << 8 | next byte) + 1
+             back in the dictionary followed by the output so far
+Over the AT MQTT client, which only takes text, a frame is sent as TEXT_PREFIX
+followed by the frame in base64.
+
+Usage as a library:
+    from nbcompress import decode_payload
+    message = decode_payload(mqtt_payload)
+Payloads that are not compressed are returned unchanged, so every uplink message
+can be passed through decode_payload().
+
+From the command line, decodes one payload per line of stdin (text or hex with --hex):
+    python tools/compress/nbcompress.py < payloads.txt
+"""
+
+import base64
+import os
+import sys
+
+FRAME_MAGIC = 0xC1  # Never valid in UTF-8, so it can not start a text message
+TEXT_PREFIX = b"~z"
+MIN_MATCH = 3
+MAX_MATCH = 18
+MAX_DISTANCE = 2048
+
+DICTIONARY_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "dictionary.bin")
+
+
+class CompressError(ValueError):
+    pass
+
+
+def load_dictionary(filename=DICTIONARY_FILE):
+    """Returns (version, dictionary bytes) as written by train_dict.py"""
+    with open(filename, "rb") as f:
+        data = f.read()
+    return data[0], data[1:]
+
+
+_dictionaries = {}
+
+
+def _dictionary(version):
+    if not _dictionaries:
+        loaded, dictionary = load_dictionary()
+        _dictionaries[loaded] = dictionary
+    if version not in _dictionaries:
+        raise CompressError("unknown dictionary version %d" % version)
+    return _dictionaries[version]
+
+
+def decompress(frame):
+    """Decodes a binary frame, raises CompressError if it is malformed"""
+    if len(frame) < 2 or frame[0] != FRAME_MAGIC:
+        raise CompressError("not a compressed frame")
+    dictionary = _dictionary(frame[1])
+    history = bytearray(dictionary)
+    pos = 2
+    while pos < len(frame):
+        c = frame[pos]
+        pos += 1
+        if c < 0x80:
+            n = c + 1
+            if pos + n > len(frame):
+                raise CompressError("literal run past the end of the frame")
+            history += frame[pos:pos + n]
+            pos += n
+        else:
+            if pos >= len(frame):
+                raise CompressError("match token past the end of the frame")
+            length = ((c >> 3) & 0x0F) + MIN_MATCH
+            distance = ((c & 0x07) << 8 | frame[pos]) + 1
+            pos += 1
+            if distance > len(history):
+                raise CompressError("match before the start of the dictionary")
+            start = len(history) - distance
+            for i in range(length):
+                history.append(history[start + i])  # Byte by byte, matches may overlap the output
+    return bytes(history[len(dictionary):])
+
+
+def compress(message, version=None):
+    """Reference encoder, produces the same frames as compressPayload() in src/NB_compress.h"""
+    if version is None:
+        version, dictionary = load_dictionary()
+    else:
+        dictionary = _dictionary(version)
+    history = bytes(dictionary) + bytes(message)
+    base = len(dictionary)
+    out = bytearray([FRAME_MAGIC, version])
+    literals = bytearray()
+
+    def flush():
+        while literals:
+            run = literals[:128]
+            out.append(len(run) - 1)
+            out.extend(run)
+            del literals[:128]
+
+    i = base
+    while i < len(history):
+        best_len, best_dist = 0, 0
+        limit = min(MAX_MATCH, len(history) - i)
+        for start in range(i - 1, max(0, i - MAX_DISTANCE) - 1, -1):
+            n = 0
+            while n < limit and history[start + n] == history[i + n]:
+                n += 1
+            if n > best_len:
+                best_len, best_dist = n, i - start
+                if n == limit:
+                    break
+        if best_len >= MIN_MATCH:
+            flush()
+            d = best_dist - 1
+            out.append(0x80 | (best_len - MIN_MATCH) << 3 | d >> 8)
+            out.append(d & 0xFF)
+            i += best_len
+        else:
+            literals.append(history[i])
+            i += 1
+    flush()
+    return bytes(out)
+
+
+def decode_payload(payload):
+    """Returns the original message of an MQTT payload, compressed or not"""
+    if isinstance(payload, str):
+        payload = payload.encode("latin-1")
+    if payload.startswith(TEXT_PREFIX):
+        try:
+            return decompress(base64.b64decode(payload[len(TEXT_PREFIX):], validate=True))
+        except (CompressError, ValueError):
+            return payload
+    if payload[:1] == bytes([FRAME_MAGIC]):
+        return decompress(payload)
+    return payload
+
+
+def main():
+    hex_input = "--hex" in sys.argv[1:]
+    for line in sys.stdin.buffer:
+        line = line.rstrip(b"\r\n")
+        if not line:
+            continue
+        payload = bytes.fromhex(line.decode()) if hex_input else line
+        try:
+            sys.stdout.buffer.write(decode_payload(payload) + b"\n")
+        except CompressError as e:
+            sys.stderr.write("%s: %s\n" % (line[:40], e))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
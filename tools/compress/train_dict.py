@@ -0,0 +1,113 @@
+"""
+Builds the static dictionary for src/NB_compress.h from sample payloads.
+
+The dictionary is the history every payload is compressed against, so the
+strings that repeat across messages (JSON keys, fixed text, the device id) can be
+sent as 2 byte matches even in the first message after boot. It is picked greedily:
+segments whose 6 byte substrings occur in the most samples go in first, and the
+substrings of a chosen segment no longer count for the next ones (as in the COVER
+algorithm of zstd --train).
+
+Writes tools/compress/dictionary.bin for the backend decoder and
+src/NB_dictionary.h for the firmware. Both must be rebuilt and deployed together;
+bump the version when the dictionary changes so the backend can keep decoding
+messages from devices that still run the old one.
+
+    python tools/compress/train_dict.py tools/compress/samples.txt --version 2
+
+The samples are one payload per line, as they are published (with the timestamp prefix).
+"""
+
+import argparse
+import os
+import sys
+from collections import Counter
+
+ROOT = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+KMER = 6     # Length of the substrings whose frequency is counted
+SEGMENT = 24 # Length of the pieces the dictionary is built from
+
+
+def train(samples, size):
+    # How many samples contain each k-mer
+    frequency = Counter()
+    for sample in samples:
+        frequency.update(set(sample[i:i + KMER] for i in range(len(sample) - KMER + 1)))
+    for kmer in [k for k, n in frequency.items() if n < 2]:
+        del frequency[kmer]
+
+    # Greedily take the segment whose k-mers are the most frequent. Its k-mers are then covered
+    # and count for nothing, so the next segments add new content instead of repeating it
+    segments = set()
+    for sample in samples:
+        for i in range(max(1, len(sample) - SEGMENT + 1)):
+            segments.add(sample[i:i + SEGMENT])
+    chosen = []
+    used = 0
+    while used < size:
+        best, bestScore = None, 0
+        for segment in segments:
+            kmers = set(segment[i:i + KMER] for i in range(len(segment) - KMER + 1))
+            score = sum(frequency[k] for k in kmers)
+            if score > bestScore or (score == bestScore and best is not None and segment < best):
+                best, bestScore = segment, score
+        if best is None:
+            break
+        best = best[:size - used]
+        for i in range(len(best) - KMER + 1):
+            frequency.pop(best[i:i + KMER], None)
+        chosen.append(best)
+        used += len(best)
+    # The most valuable segments last, closest to the message
+    return b"".join(reversed(chosen))
+
+
+def write_header(dictionary, version, filename):
+    lines = [
+        "// Generated by tools/compress/train_dict.py from sample payloads - do not edit",
+        "#ifndef NB_DICTIONARY_H",
+        "#define NB_DICTIONARY_H",
+        "",
+        "#include <stdint.h>",
+        "",
+        "#define COMPRESS_DICT_VERSION %d" % version,
+        "",
+        "// %d bytes" % len(dictionary),
+        "const uint8_t COMPRESS_DICT[] = {",
+    ]
+    for i in range(0, len(dictionary), 16):
+        lines.append("  " + ", ".join("0x%02x" % b for b in dictionary[i:i + 16]) + ",")
+    lines.append("};")
+    lines.append("")
+    lines.append("#endif // NB_DICTIONARY_H")
+    with open(filename, "w") as f:
+        f.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("samples", help="file with one sample payload per line")
+    parser.add_argument("--size", type=int, default=512, help="dictionary size in bytes, at most 1024")
+    parser.add_argument("--version", type=int, required=True, help="dictionary version, 0-255")
+    args = parser.parse_args()
+
+    with open(args.samples, "rb") as f:
+        samples = [line.rstrip(b"\r\n") for line in f if line.strip()]
+    dictionary = train(samples, min(args.size, 1024))
+
+    with open(os.path.join(ROOT, "tools", "compress", "dictionary.bin"), "wb") as f:
+        f.write(bytes([args.version]) + dictionary)
+    write_header(dictionary, args.version, os.path.join(ROOT, "src", "NB_dictionary.h"))
+
+    # Report what the dictionary gains on the samples
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    import nbcompress
+    nbcompress._dictionaries.clear()
+    raw = sum(len(s) for s in samples)
+    packed = sum(len(nbcompress.compress(s)) for s in samples)
+    print("%d byte dictionary, %d samples, %d -> %d bytes (%.0f%%)" %
+          (len(dictionary), len(samples), raw, packed, 100.0 * packed / raw))
+
+
+if __name__ == "__main__":
+    main()
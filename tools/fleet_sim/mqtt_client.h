@@ -0,0 +1,354 @@
+/**
+ * @file mqtt_client.h
+ * @author Bergma
+ * @brief Minimal blocking MQTT 3.1.1 client over a POSIX TCP socket, for the host tools
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Supports what the simulated modems and the latency subscriber need: CONNECT,
+ * @details PUBLISH at QoS 0 and 1, SUBSCRIBE, PINGREQ and DISCONNECT. No TLS, no QoS 2.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK 9
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+class MqttClient
+{
+public:
+  MqttClient() : fd(-1), packetId(0) {}
+  ~MqttClient() { close(); }
+
+  bool connected() const { return fd >= 0; }
+
+  /**
+   * @brief Opens the TCP connection and logs in
+   * @param host Broker hostname or address
+   * @param port Broker port
+   * @param clientId MQTT client ID
+   * @param keepalive Keepalive interval in seconds
+   * @param timeoutMs Socket timeout for the connect and every later read
+   * @return 0 if successful, 1 if the connection failed, 2 if the broker refused the login
+   */
+  int connect(const char *host, int port, const char *clientId, int keepalive, int timeoutMs)
+  {
+    close();
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char portText[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portText, sizeof(portText), "%d", port);
+    if (getaddrinfo(host, portText, &hints, &res) != 0 || res == NULL)
+    {
+      return 1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0)
+    {
+      freeaddrinfo(res);
+      return 1;
+    }
+    setTimeout(timeoutMs);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (::connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+      freeaddrinfo(res);
+      close();
+      return 1;
+    }
+    freeaddrinfo(res);
+
+    std::vector<uint8_t> body;
+    putString(body, "MQTT");
+    body.push_back(4);    // Protocol level 3.1.1
+    body.push_back(0x02); // Clean session
+    body.push_back(keepalive >> 8);
+    body.push_back(keepalive & 0xFF);
+    putString(body, clientId);
+    if (sendPacket(MQTT_CONNECT << 4, body))
+    {
+      return 1;
+    }
+
+    uint8_t type;
+    if (readPacket(&type, body) || (type >> 4) != MQTT_CONNACK || body.size() < 2)
+    {
+      close();
+      return 1;
+    }
+    if (body[1] != 0)
+    {
+      close();
+      return 2;
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Publishes a message. At QoS 1 it waits for the PUBACK
+   * @return 0 if successful, 1 if not
+   */
+  int publish(const char *topic, const char *payload, int len, int qos, int retain)
+  {
+    std::vector<uint8_t> body;
+    putString(body, topic);
+    uint16_t id = 0;
+    if (qos > 0)
+    {
+      id = nextId();
+      body.push_back(id >> 8);
+      body.push_back(id & 0xFF);
+    }
+    body.insert(body.end(), payload, payload + len);
+    if (sendPacket((MQTT_PUBLISH << 4) | ((qos > 0 ? 1 : 0) << 1) | (retain ? 1 : 0), body))
+    {
+      return 1;
+    }
+    if (qos == 0)
+    {
+      return 0;
+    }
+    uint8_t type;
+    while (readPacket(&type, body) == 0)
+    {
+      if ((type >> 4) == MQTT_PUBACK && body.size() >= 2 && ((body[0] << 8) | body[1]) == id)
+      {
+        return 0;
+      }
+    }
+    return 1;
+  }
+
+  /**
+   * @brief Subscribes to a topic filter at QoS 0 and waits for the SUBACK
+   * @return 0 if successful, 1 if not
+   */
+  int subscribe(const char *filter)
+  {
+    std::vector<uint8_t> body;
+    uint16_t id = nextId();
+    body.push_back(id >> 8);
+    body.push_back(id & 0xFF);
+    putString(body, filter);
+    body.push_back(0);
+    if (sendPacket((MQTT_SUBSCRIBE << 4) | 0x02, body))
+    {
+      return 1;
+    }
+    uint8_t type;
+    while (readPacket(&type, body) == 0)
+    {
+      if ((type >> 4) == MQTT_SUBACK)
+      {
+        return body.size() >= 3 && body[2] != 0x80 ? 0 : 1;
+      }
+    }
+    return 1;
+  }
+
+  /**
+   * @brief Sends a PINGREQ. The PINGRESP is skipped by the next read
+   * @return 0 if successful, 1 if not
+   */
+  int ping()
+  {
+    std::vector<uint8_t> body;
+    return sendPacket(MQTT_PINGREQ << 4, body);
+  }
+
+  /**
+   * @brief Sends DISCONNECT and closes the socket
+   */
+  void disconnect()
+  {
+    if (fd >= 0)
+    {
+      std::vector<uint8_t> body;
+      sendPacket(MQTT_DISCONNECT << 4, body);
+    }
+    close();
+  }
+
+  /**
+   * @brief Closes the socket without telling the broker, like a lost radio link
+   */
+  void close()
+  {
+    if (fd >= 0)
+    {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  /**
+   * @brief Reads one packet
+   * @param type Fixed header byte (packet type and flags)
+   * @param body Variable header and payload
+   * @return 0 if successful, 1 on timeout or error. The connection is closed on error
+   */
+  int readPacket(uint8_t *type, std::vector<uint8_t> &body)
+  {
+    uint8_t b;
+    if (readAll(type, 1))
+    {
+      return 1;
+    }
+    uint32_t len = 0;
+    int shift = 0;
+    do
+    {
+      if (readAll(&b, 1) || shift > 21)
+      {
+        close();
+        return 1;
+      }
+      len |= (uint32_t)(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    body.resize(len);
+    if (len > 0 && readAll(&body[0], len))
+    {
+      close();
+      return 1;
+    }
+    return 0;
+  }
+
+  /**
+   * @brief Splits a received PUBLISH body into topic and payload
+   * @return 0 if successful, 1 if malformed
+   */
+  static int parsePublish(uint8_t type, const std::vector<uint8_t> &body, std::string &topic, std::string &payload)
+  {
+    if (body.size() < 2)
+    {
+      return 1;
+    }
+    size_t topicLen = (body[0] << 8) | body[1];
+    size_t offset = 2 + topicLen + (((type >> 1) & 3) ? 2 : 0);
+    if (offset > body.size())
+    {
+      return 1;
+    }
+    topic.assign((const char *)&body[2], topicLen);
+    payload.assign((const char *)&body[0] + offset, body.size() - offset);
+    return 0;
+  }
+
+private:
+  int fd;
+  uint16_t packetId;
+
+  uint16_t nextId()
+  {
+    if (++packetId == 0)
+    {
+      packetId = 1;
+    }
+    return packetId;
+  }
+
+  void setTimeout(int timeoutMs)
+  {
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+
+  static void putString(std::vector<uint8_t> &out, const char *text)
+  {
+    size_t len = strlen(text);
+    out.push_back(len >> 8);
+    out.push_back(len & 0xFF);
+    out.insert(out.end(), text, text + len);
+  }
+
+  int sendPacket(uint8_t header, const std::vector<uint8_t> &body)
+  {
+    if (fd < 0)
+    {
+      return 1;
+    }
+    std::vector<uint8_t> packet;
+    packet.reserve(body.size() + 5);
+    packet.push_back(header);
+    size_t len = body.size();
+    do
+    {
+      uint8_t b = len & 0x7F;
+      len >>= 7;
+      packet.push_back(len ? b | 0x80 : b);
+    } while (len);
+    packet.insert(packet.end(), body.begin(), body.end());
+
+    size_t sent = 0;
+    while (sent < packet.size())
+    {
+      ssize_t n = ::send(fd, &packet[sent], packet.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+      {
+        close();
+        return 1;
+      }
+      sent += n;
+    }
+    return 0;
+  }
+
+  int readAll(uint8_t *buf, size_t len)
+  {
+    if (fd < 0)
+    {
+      return 1;
+    }
+    size_t got = 0;
+    while (got < len)
+    {
+      ssize_t n = ::recv(fd, buf + got, len - got, 0);
+      if (n <= 0)
+      {
+        if (n == 0)
+        {
+          close();
+        }
+        return 1;
+      }
+      got += n;
+    }
+    return 0;
+  }
+};
+
+#endif // MQTT_CLIENT_H
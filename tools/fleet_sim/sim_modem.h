@@ -0,0 +1,639 @@
+/**
+ * @file sim_modem.h
+ * @author Bergma
+ * @brief Simulated U-Blox R410M that plugs into NB_R410M as its transport
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Answers the AT commands used by the driver with the responses the real module gives,
+ * @details delayed according to a coverage profile. The AT MQTT client is backed by a real MQTT
+ * @details connection, so traffic from the simulated devices ends up at a (local) broker. The socket
+ * @details commands (+USOCR, +USOCO, +USOWR, +USORD) are backed by a plain TCP connection to the
+ * @details broker, for the MQTT client of NB_mqtt_socket.h. TLS is not simulated, only its delay.
+ * @details Concatenated command lines (AT+A;+B) are run as the module does, see handleBatch().
+ * @details Each instance is used by one device thread only and needs no locking.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef SIM_MODEM_H
+#define SIM_MODEM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "mqtt_client.h"
+
+/**
+ * @brief Radio conditions of one simulated device
+ */
+typedef struct
+{
+  const char *name;
+  unsigned long registerMinMs; // Time from power on until registered
+  unsigned long registerMaxMs;
+  int rsrp;                    // +CESQ RSRP index, 0-97
+  int rsrq;                    // +CESQ RSRQ index, 0-34
+  int rssi;                    // +CSQ RSSI index, 0-31
+  unsigned long networkMs;     // Extra latency of commands that go over the air
+  double failRate;             // Probability that a publish or login fails
+} coverage_profile_t;
+
+const coverage_profile_t COVERAGE_GOOD = {"good", 1000, 3000, 60, 25, 20, 50, 0.0};
+const coverage_profile_t COVERAGE_MARGINAL = {"marginal", 5000, 15000, 25, 12, 8, 400, 0.02};
+const coverage_profile_t COVERAGE_POOR = {"poor", 20000, 40000, 12, 4, 3, 1500, 0.10};
+
+/**
+ * @brief Settings shared by all simulated modems
+ */
+struct SimNetwork
+{
+  std::string brokerHost;
+  int brokerPort;
+  std::atomic<int> stormEpoch; // Incremented to drop every MQTT connection at once
+
+  SimNetwork() : brokerHost("127.0.0.1"), brokerPort(1883), stormEpoch(0) {}
+};
+
+class SimModem
+{
+public:
+  SimModem(SimNetwork &network, const coverage_profile_t &profile, uint32_t seed)
+      : net(network), coverage(profile), rng(seed), stormEpoch(network.stormEpoch.load()), certRemaining(0),
+        certType(0), keepalive(60), loggedIn(false), resumption(false), tlsSession(false), lastMqttMs(0), socketFd(-1),
+        socketSecure(false), socketRemaining(0), batch(NULL), batchError(false)
+  {
+    powerOnMs = nowMs();
+    std::uniform_int_distribution<unsigned long> reg(profile.registerMinMs, profile.registerMaxMs);
+    registerMs = reg(rng);
+  }
+
+  ~SimModem() { closeSocket(); }
+
+  // Transport interface used by NB_R410M
+
+  void begin(unsigned long) {}
+
+  int available()
+  {
+    unsigned long now = nowMs();
+    if (!rx.empty() && rx.front().readyMs <= now)
+    {
+      return 1;
+    }
+    // Block briefly instead of letting the driver spin, thousands of devices share the CPU
+    unsigned long wait = 2;
+    if (!rx.empty() && rx.front().readyMs - now < wait)
+    {
+      wait = rx.front().readyMs - now;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+    return !rx.empty() && rx.front().readyMs <= nowMs();
+  }
+
+  int read()
+  {
+    if (rx.empty())
+    {
+      return -1;
+    }
+    chunk_t &chunk = rx.front();
+    int c = (unsigned char)chunk.data[chunk.pos++];
+    if (chunk.pos >= chunk.data.size())
+    {
+      rx.pop_front();
+    }
+    return c;
+  }
+
+  size_t print(const char *text)
+  {
+    return write((const uint8_t *)text, strlen(text));
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    for (size_t i = 0; i < size; i++)
+    {
+      if (socketRemaining > 0)
+      {
+        socketData += (char)data[i];
+        if (--socketRemaining == 0)
+        {
+          socketWrite();
+        }
+        continue;
+      }
+      if (certRemaining > 0)
+      {
+        if (--certRemaining == 0)
+        {
+          char text[64];
+          snprintf(text, sizeof(text), "\r\n+USECMNG: 0,%d,\"%s\",\"0\"\r\n\r\nOK\r\n", certType, certName.c_str());
+          respond(text, 50);
+        }
+        continue;
+      }
+      if (data[i] == '\r')
+      {
+        handleCommand(line);
+        line.clear();
+      }
+      else if (data[i] != '\n')
+      {
+        line += (char)data[i];
+      }
+    }
+    return size;
+  }
+
+  /**
+   * @brief Background work the real module does on its own: keepalive pings and dropped links
+   * @return 1 if the MQTT link was just dropped by a reconnect storm, 0 otherwise
+   */
+  int service()
+  {
+    if ((loggedIn || socketFd >= 0) && stormEpoch != net.stormEpoch.load())
+    {
+      // Reconnect storm, the link is lost without a DISCONNECT
+      stormEpoch = net.stormEpoch.load();
+      mqtt.close();
+      closeSocket();
+      loggedIn = false;
+      return 1;
+    }
+    if (loggedIn && nowMs() - lastMqttMs > (unsigned long)keepalive * 1000 / 2)
+    {
+      if (mqtt.ping())
+      {
+        loggedIn = false;
+      }
+      lastMqttMs = nowMs();
+    }
+    return 0;
+  }
+
+  bool mqttConnected() const { return loggedIn || socketFd >= 0; }
+
+private:
+  typedef struct
+  {
+    std::string data;
+    size_t pos;
+    unsigned long readyMs;
+  } chunk_t;
+
+  SimNetwork &net;
+  const coverage_profile_t &coverage;
+  std::mt19937 rng;
+  int stormEpoch;
+  std::deque<chunk_t> rx;
+  std::string line;
+  unsigned long powerOnMs;
+  unsigned long registerMs;
+  int certRemaining;
+  int certType;
+  std::string certName;
+  std::string clientId;
+  int keepalive;
+  MqttClient mqtt;
+  bool loggedIn;
+  bool resumption; // TLS session resumption enabled with +USECPRF
+  bool tlsSession; // The last login left a session to resume
+  unsigned long lastMqttMs;
+  int socketFd;          // TCP connection behind socket 0, -1 if closed
+  bool socketSecure;     // +USOSEC enabled TLS on socket 0
+  int socketRemaining;   // Bytes of +USOWR data still to come
+  std::string socketData;
+  std::string *batch;    // Information responses of the concatenated line being run, NULL if none
+  bool batchError;
+
+  static unsigned long nowMs()
+  {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  bool fails()
+  {
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    return dist(rng) < coverage.failRate;
+  }
+
+  void respond(const std::string &text, unsigned long delayMs)
+  {
+    if (batch != NULL)
+    {
+      // Only commands with a plain OK can be concatenated, anything else ends the line with ERROR
+      batchError = true;
+      return;
+    }
+    // Responses come out in order, each after the previous one
+    unsigned long start = nowMs();
+    if (!rx.empty() && rx.back().readyMs > start)
+    {
+      start = rx.back().readyMs;
+    }
+    chunk_t chunk;
+    chunk.data = text;
+    chunk.pos = 0;
+    chunk.readyMs = start + delayMs;
+    rx.push_back(chunk);
+  }
+
+  void ok(const char *info)
+  {
+    if (batch != NULL)
+    {
+      if (info != NULL)
+      {
+        *batch += std::string("\r\n") + info + "\r\n";
+      }
+      return;
+    }
+    std::string text = "\r\n";
+    if (info != NULL)
+    {
+      text += info;
+      text += "\r\n\r\n";
+    }
+    text += "OK\r\n";
+    respond(text, 10);
+  }
+
+  bool registered() const { return nowMs() - powerOnMs >= registerMs; }
+
+  void handleCommand(const std::string &cmd)
+  {
+    char text[128];
+    if (cmd.compare(0, 2, "AT") != 0)
+    {
+      return;
+    }
+    std::string c = cmd.substr(2);
+    if (batch == NULL && splitCommand(c, 0) < c.size())
+    {
+      handleBatch(c);
+      return;
+    }
+
+    if (c.empty() || c == "E0" || c.compare(0, 6, "+CTZU=") == 0 || c.compare(0, 8, "+UGPIOC=") == 0 ||
+        c.compare(0, 9, "+CGDCONT=") == 0 || c.compare(0, 9, "+USECPRF=") == 0)
+    {
+      if (c.compare(0, 9, "+USECPRF=") == 0 && c.find(",13,1") != std::string::npos)
+      {
+        resumption = true;
+      }
+      else if (c.compare(0, 9, "+USECPRF=") == 0 && c.find(',') == std::string::npos)
+      {
+        // Reset of the profile to its defaults
+        resumption = false;
+      }
+      ok(NULL);
+    }
+    else if (c == "+CEREG?")
+    {
+      snprintf(text, sizeof(text), "+CEREG: 0,%d", registered() ? 1 : 2);
+      ok(text);
+    }
+    else if (c == "+CGDCONT?")
+    {
+      snprintf(text, sizeof(text), "+CGDCONT: 1,\"IP\",\"sim.apn\",\"%s\",0,0,0,0",
+               registered() ? "10.0.0.1" : "0.0.0.0");
+      ok(text);
+    }
+    else if (c == "+CESQ")
+    {
+      snprintf(text, sizeof(text), "+CESQ: 99,99,255,255,%d,%d", coverage.rsrq, coverage.rsrp);
+      ok(text);
+    }
+    else if (c == "+CSQ")
+    {
+      snprintf(text, sizeof(text), "+CSQ: %d,99", coverage.rssi);
+      ok(text);
+    }
+    else if (c == "+CCLK?")
+    {
+      time_t now = time(NULL);
+      struct tm utc;
+      gmtime_r(&now, &utc);
+      snprintf(text, sizeof(text), "+CCLK: \"%02d/%02d/%02d,%02d:%02d:%02d+00\"", utc.tm_year % 100, utc.tm_mon + 1,
+               utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec);
+      ok(text);
+    }
+    else if (c.compare(0, 11, "+USECMNG=0,") == 0)
+    {
+      // +USECMNG=0,<type>,"<name>",<size>
+      char name[64] = "";
+      int size = 0;
+      if (sscanf(c.c_str() + 11, "%d,\"%63[^\"]\",%d", &certType, name, &size) == 3 && size > 0)
+      {
+        certName = name;
+        certRemaining = size;
+        respond(">", 20);
+      }
+      else
+      {
+        respond("\r\nERROR\r\n", 10);
+      }
+    }
+    else if (c.compare(0, 9, "+UMQTT=0,") == 0)
+    {
+      clientId = c.substr(9);
+      if (clientId.size() >= 2 && clientId[0] == '"')
+      {
+        clientId = clientId.substr(1, clientId.size() - 2);
+      }
+      ok("+UMQTT: 0,1");
+    }
+    else if (c.compare(0, 9, "+UMQTT=2,") == 0)
+    {
+      // The simulated devices always talk to the configured local broker
+      ok("+UMQTT: 2,1");
+    }
+    else if (c.compare(0, 10, "+UMQTT=10,") == 0)
+    {
+      keepalive = atoi(c.c_str() + 10);
+      if (keepalive <= 0)
+      {
+        keepalive = 60;
+      }
+      ok("+UMQTT: 10,1");
+    }
+    else if (c.compare(0, 10, "+UMQTT=11,") == 0)
+    {
+      ok("+UMQTT: 11,1");
+    }
+    else if (c.compare(0, 13, "+UMQTTWTOPIC=") == 0)
+    {
+      ok("+UMQTTWTOPIC: 1");
+    }
+    else if (c.compare(0, 11, "+UMQTTWMSG=") == 0)
+    {
+      ok("+UMQTTWMSG: 1");
+    }
+    else if (c == "+UMQTTC=8,1")
+    {
+      ok("+UMQTTC: 8,1");
+    }
+    else if (c == "+USOCR=6")
+    {
+      closeSocket();
+      socketSecure = false;
+      ok("+USOCR: 0");
+    }
+    else if (c.compare(0, 8, "+USOSEC=") == 0)
+    {
+      socketSecure = true;
+      ok(NULL);
+    }
+    else if (c.compare(0, 7, "+USOCO=") == 0)
+    {
+      socketConnect();
+    }
+    else if (c.compare(0, 7, "+USOWR=") == 0)
+    {
+      // +USOWR=<socket>,<length>, the data follows the @ prompt
+      int length = atoi(c.c_str() + c.find(',') + 1);
+      if (socketFd < 0 || length <= 0)
+      {
+        respond("\r\nERROR\r\n", 10);
+        return;
+      }
+      socketData.clear();
+      socketRemaining = length;
+      respond("@", 10);
+    }
+    else if (c.compare(0, 7, "+USORD=") == 0)
+    {
+      socketRead(atoi(c.c_str() + c.find(',') + 1));
+    }
+    else if (c.compare(0, 7, "+USOCL=") == 0)
+    {
+      closeSocket();
+      ok(NULL);
+    }
+    else if (c == "+UMQTTC=1")
+    {
+      login();
+    }
+    else if (c == "+UMQTTC=0")
+    {
+      mqtt.disconnect();
+      loggedIn = false;
+      ok("+UMQTTC: 0,1");
+    }
+    else if (c.compare(0, 10, "+UMQTTC=2,") == 0)
+    {
+      publish(c.substr(10));
+    }
+    else
+    {
+      respond("\r\nERROR\r\n", 10);
+    }
+  }
+
+  /**
+   * @brief Runs a concatenated command line (AT+A;+B;+C) like the module: the commands run in order,
+   * @brief their information responses come out together and one final result code ends them
+   */
+  void handleBatch(const std::string &c)
+  {
+    std::string info;
+    batch = &info;
+    batchError = false;
+    for (size_t start = 0; start <= c.size() && !batchError;)
+    {
+      size_t end = splitCommand(c, start);
+      handleCommand("AT" + c.substr(start, end - start));
+      start = end + 1;
+    }
+    batch = NULL;
+    respond(info + (batchError ? "\r\nERROR\r\n" : "\r\nOK\r\n"), 10);
+  }
+
+  /**
+   * @brief Position of the next command separator from start, the length of the line if there is none
+   * @details A separator is a semicolon outside quotes followed by the next extended command, so the
+   * @details unquoted message of +UMQTTC=2 may contain semicolons
+   */
+  static size_t splitCommand(const std::string &c, size_t start)
+  {
+    bool quoted = false;
+    for (size_t i = start; i < c.size(); i++)
+    {
+      if (c[i] == '"')
+      {
+        quoted = !quoted;
+      }
+      else if (c[i] == ';' && !quoted && i + 1 < c.size() && c[i + 1] == '+')
+      {
+        return i;
+      }
+    }
+    return c.size();
+  }
+
+  void login()
+  {
+    ok("+UMQTTC: 1,1");
+    // Over the air handshake, several round trips. Resuming the TLS session saves the certificate
+    // exchange and a round trip
+    std::this_thread::sleep_for(std::chrono::milliseconds(coverage.networkMs * (resumption && tlsSession ? 2 : 4)));
+    bool success = registered() && !fails() &&
+                   mqtt.connect(net.brokerHost.c_str(), net.brokerPort, clientId.c_str(), keepalive, 10000) == 0;
+    loggedIn = success;
+    tlsSession = success;
+    stormEpoch = net.stormEpoch.load();
+    lastMqttMs = nowMs();
+    // The result arrives as an unsolicited result code
+    respond(success ? "\r\n+UUMQTTC: 1,0\r\n" : "\r\n+UUMQTTC: 1,1\r\n", 10);
+  }
+
+  void closeSocket()
+  {
+    if (socketFd >= 0)
+    {
+      ::close(socketFd);
+      socketFd = -1;
+    }
+  }
+
+  void socketConnect()
+  {
+    // Connecting includes the TLS handshake, which resumption shortens as for the MQTT client
+    int trips = socketSecure ? (resumption && tlsSession ? 2 : 4) : 1;
+    std::this_thread::sleep_for(std::chrono::milliseconds(coverage.networkMs * trips));
+    closeSocket();
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    char port[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", net.brokerPort);
+    if (registered() && !fails() && getaddrinfo(net.brokerHost.c_str(), port, &hints, &res) == 0)
+    {
+      socketFd = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+      if (socketFd >= 0 && ::connect(socketFd, res->ai_addr, res->ai_addrlen) != 0)
+      {
+        closeSocket();
+      }
+      freeaddrinfo(res);
+    }
+    if (socketFd < 0)
+    {
+      tlsSession = false;
+      respond("\r\nERROR\r\n", 10);
+      return;
+    }
+    int one = 1;
+    setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    tlsSession = socketSecure;
+    stormEpoch = net.stormEpoch.load();
+    ok(NULL);
+  }
+
+  void socketWrite()
+  {
+    // Uplink over the air before the data reaches the broker
+    std::this_thread::sleep_for(std::chrono::milliseconds(coverage.networkMs));
+    size_t sent = 0;
+    while (socketFd >= 0 && sent < socketData.size())
+    {
+      ssize_t n = ::send(socketFd, socketData.data() + sent, socketData.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+      {
+        closeSocket();
+        break;
+      }
+      sent += n;
+    }
+    if (socketFd < 0)
+    {
+      respond("\r\nERROR\r\n", 10);
+      return;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "+USOWR: 0,%u", (unsigned)socketData.size());
+    ok(text);
+  }
+
+  void socketRead(int length)
+  {
+    if (socketFd < 0)
+    {
+      respond("\r\nERROR\r\n", 10);
+      return;
+    }
+    std::string data(length > 0 ? length : 0, '\0');
+    ssize_t n = length > 0 ? ::recv(socketFd, &data[0], length, MSG_DONTWAIT) : 0;
+    if (n == 0 && length > 0)
+    {
+      // The broker closed the connection
+      closeSocket();
+      respond("\r\nERROR\r\n", 10);
+      return;
+    }
+    if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        closeSocket();
+        respond("\r\nERROR\r\n", 10);
+        return;
+      }
+      n = 0;
+    }
+    if (n == 0)
+    {
+      // Nothing buffered, the module leaves out the data field
+      respond("\r\n+USORD: 0,0\r\n\r\nOK\r\n", 10);
+      return;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "\r\n+USORD: 0,%d,\"", (int)n);
+    respond(text + data.substr(0, n) + "\"\r\n\r\nOK\r\n", 10);
+  }
+
+  void publish(const std::string &args)
+  {
+    // <QoS>,<retain>,<topic>,<message>
+    int qos = atoi(args.c_str());
+    size_t p1 = args.find(',');
+    size_t p2 = p1 == std::string::npos ? p1 : args.find(',', p1 + 1);
+    size_t p3 = p2 == std::string::npos ? p2 : args.find(',', p2 + 1);
+    if (p3 == std::string::npos)
+    {
+      respond("\r\nERROR\r\n", 10);
+      return;
+    }
+    int retain = atoi(args.c_str() + p1 + 1);
+    std::string topic = args.substr(p2 + 1, p3 - p2 - 1);
+    std::string message = args.substr(p3 + 1);
+
+    // Uplink over the air before the message reaches the broker
+    std::this_thread::sleep_for(std::chrono::milliseconds(coverage.networkMs));
+    bool success = loggedIn && !fails() &&
+                   mqtt.publish(topic.c_str(), message.c_str(), message.size(), qos, retain) == 0;
+    if (!success && !mqtt.connected())
+    {
+      loggedIn = false;
+    }
+    lastMqttMs = nowMs();
+    respond(success ? "\r\n+UMQTTC: 2,1\r\n\r\nOK\r\n" : "\r\n+UMQTTC: 2,0\r\n\r\nOK\r\n", 10);
+  }
+};
+
+#endif // SIM_MODEM_H
@@ -0,0 +1,300 @@
+/**
+ * @file replay.cpp
+ * @author Bergma
+ * @brief Replays a UART transcript recorded on a device against the driver, for latency regression tests
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details Record a transcript by building the firmware with -DUART_TRANSCRIPT, which saves the traffic
+ * @details of a full setup() to /transcript.bin on SPIFFS (/transcript_resume.bin after a resumed
+ * @details session), and download the file from the device. The replay runs the same driver calls as
+ * @details initConnection() in src/main.cpp (or resumeSession() with --resume) on an
+ * @details NB_R410M<ReplayTransport> and answers every command with the recorded response at the recorded
+ * @details timing, see replay_transport.h. It reports the time of every step in the recording and in the
+ * @details replay, and exits with 1 if the replay takes longer than --max-ms or if the driver sends a
+ * @details command that is not in the transcript.
+ * @details The configuration step is configureConnection() from NB_connect.h, as in initConnection(). Its
+ * @details commands are sent as concatenated lines, or one by one with --no-batch. A transcript recorded
+ * @details without batching answers both, one recorded with batching only the concatenated lines.
+ * @details A transcript of a SAS_AUTH build is recognised by its AT+UMQTT=4 login and replayed without the
+ * @details client certificate and key, --sas and --cert choose the sequence explicitly. EMBED_CERTS sends the
+ * @details same commands as a build that reads the certificates from SPIFFS.
+ * @details Build with PlatformIO (pio run -e replay) or directly:
+ * @details   g++ -std=c++11 -O2 -Isrc -Itools/replay tools/replay/replay.cpp -o replay
+ * @details Example, check that setup still completes within 40 s of module time, at 10x speed:
+ * @details   ./replay transcript.bin --speed 10 --max-ms 40000
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "NB_R410M.h"
+#include "NB_connect.h"
+#include "replay_transport.h"
+
+ReplayTransport *replayClock = NULL;
+int verboseConsole = 0;
+int batchConfigure = 1;
+
+unsigned long millis()
+{
+  return replayClock->millis();
+}
+
+void delay(unsigned long ms)
+{
+  replayClock->advance(ms);
+}
+
+void printToConsole(const char *text)
+{
+  if (verboseConsole)
+  {
+    fputs(text, stdout);
+  }
+}
+
+// Settings the device was set up with, as in src/main.cpp. Differences are counted as changed commands
+const char APN[] = "lpwa.telia.iot";
+const char HOST[] = "NBIoTLS.azure-devices.net";
+const char IDENTITY[] = "nb1";
+const char USERNAME[] = "NBIoTLS.azure-devices.net/nb1/?api-version=2021-04-12";
+const char TOPIC[] = "devices/nb1/messages/events/";
+const int PORT = 8883;
+const int SEC_PROFILE = 2;
+// The certificate contents are not checked, only the import exchanges are replayed. Same for the SAS token
+const uint8_t DUMMY_CERT[1024] = {0};
+const char DUMMY_TOKEN[] = "SharedAccessSignature sr=NBIoTLS.azure-devices.net%2Fdevices%2Fnb1";
+
+#define AUTH_ANY 0  // Step of every build
+#define AUTH_CERT 1 // Step of a build that logs in with the client certificate
+#define AUTH_SAS 2  // Step of a SAS_AUTH build
+
+NB_R410M<ReplayTransport> *modem = NULL;
+
+/**
+ * @brief One driver call of the sequence under test
+ */
+typedef struct
+{
+  const char *name;
+  int (*run)();
+  int auth; // One of the AUTH_ values
+} replay_step_t;
+
+int sasAuth = 0;
+
+int stepInit() { return modem->initModule(30000); }
+int stepAPN() { return modem->setAPN(APN); }
+int stepNetwork()
+{
+  modem->getNetwork();
+  return modem->registration != 1 && modem->registration != 5;
+}
+int stepClock()
+{
+  // The same exchange as syncNetworkTime(), which needs the RTC of the ESP32
+  char command[16];
+  char response[AT_RESPONSE_SIZE];
+  sprintf(command, "%s%s", AT, SARA_CLOCK_GET);
+  modem->transmitCommand(command);
+  return modem->readResponse(response, sizeof(response), 1000) < 0;
+}
+int stepInfo() { return modem->printInfo() == NULL; }
+int stepCA() { return modem->setCertMQTT(DUMMY_CERT, sizeof(DUMMY_CERT), 0, "ca"); }
+int stepCert() { return modem->setCertMQTT(DUMMY_CERT, sizeof(DUMMY_CERT), 1, "cert"); }
+int stepKey() { return modem->setCertMQTT(DUMMY_CERT, sizeof(DUMMY_CERT), 2, "key"); }
+int stepAuth() { return modem->setMQTTauth(USERNAME, DUMMY_TOKEN); }
+int stepConfigure()
+{
+  // The same sequence as initConnection(), batched unless --no-batch
+  connect_config_t config = {HOST, PORT, IDENTITY, TOPIC, "Unintented disconnect", 60, SEC_PROFILE, "ca",
+                             sasAuth ? NULL : "cert", sasAuth ? NULL : "key", 1, batchConfigure};
+  return configureConnection(*modem, &config);
+}
+int stepLogin() { return modem->loginMQTT(); }
+int stepRegistration()
+{
+  int stat = modem->queryRegistration();
+  return stat != 1 && stat != 5;
+}
+
+const replay_step_t SETUP_STEPS[] = {
+    {"initModule", stepInit, AUTH_ANY},
+    {"setAPN", stepAPN, AUTH_ANY},
+    {"getNetwork", stepNetwork, AUTH_ANY},
+    {"syncNetworkTime", stepClock, AUTH_ANY},
+    {"printInfo", stepInfo, AUTH_ANY},
+    {"import CA", stepCA, AUTH_ANY},
+    {"import cert", stepCert, AUTH_CERT},
+    {"import key", stepKey, AUTH_CERT},
+    {"setMQTTauth", stepAuth, AUTH_SAS},
+    {"configure", stepConfigure, AUTH_ANY},
+    {"loginMQTT", stepLogin, AUTH_ANY},
+};
+
+const replay_step_t RESUME_STEPS[] = {
+    {"queryRegistration", stepRegistration, AUTH_ANY},
+};
+
+/**
+ * @brief Checks if a transcript was recorded by a SAS_AUTH build, which logs in with a username and token
+ */
+int recordedSas(const std::vector<replay_exchange_t> &exchanges)
+{
+  std::string login = std::string(AT) + SARA_MQTT_AUTH;
+  for (size_t i = 0; i < exchanges.size(); i++)
+  {
+    if (exchanges[i].text.find(login) != std::string::npos)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void usage()
+{
+  printf("replay TRANSCRIPT [options]\n"
+         "  --speed X     virtual ms per wall clock ms, 1 for the original timing (0, as fast as possible)\n"
+         "  --max-ms MS   fail if the sequence takes longer than this in module time (off)\n"
+         "  --resume      replay the resumeSession() check instead of the full setup\n"
+         "  --no-batch    send the configuration commands one by one instead of as one line\n"
+         "  --sas         replay the SAS_AUTH sequence (detected from the transcript)\n"
+         "  --cert        replay the client certificate sequence (detected from the transcript)\n"
+         "  --verbose     print the driver output and every mismatch\n");
+}
+
+int main(int argc, char **argv)
+{
+  const char *filename = NULL;
+  double speed = 0;
+  long maxMs = -1;
+  int resume = 0;
+  int auth = AUTH_ANY; // Detected from the transcript
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--resume") == 0)
+    {
+      resume = 1;
+    }
+    else if (strcmp(arg, "--no-batch") == 0)
+    {
+      batchConfigure = 0;
+    }
+    else if (strcmp(arg, "--sas") == 0)
+    {
+      auth = AUTH_SAS;
+    }
+    else if (strcmp(arg, "--cert") == 0)
+    {
+      auth = AUTH_CERT;
+    }
+    else if (strcmp(arg, "--verbose") == 0)
+    {
+      verboseConsole = 1;
+    }
+    else if (strcmp(arg, "--speed") == 0 && value != NULL)
+    {
+      speed = atof(value), i++;
+    }
+    else if (strcmp(arg, "--max-ms") == 0 && value != NULL)
+    {
+      maxMs = atol(value), i++;
+    }
+    else if (arg[0] != '-' && filename == NULL)
+    {
+      filename = arg;
+    }
+    else
+    {
+      usage();
+      return 1;
+    }
+  }
+  if (filename == NULL)
+  {
+    usage();
+    return 1;
+  }
+
+  std::vector<replay_exchange_t> exchanges;
+  int loaded = loadTranscript(filename, exchanges);
+  if (loaded)
+  {
+    fprintf(stderr, loaded == 1 ? "Can not read %s\n" : "%s is not a valid transcript\n", filename);
+    return 1;
+  }
+  unsigned long recordedMs = exchanges.empty() ? 0 : exchanges.back().lastRxMs - exchanges.front().txMs;
+  if (auth == AUTH_ANY)
+  {
+    auth = recordedSas(exchanges) ? AUTH_SAS : AUTH_CERT;
+  }
+  sasAuth = auth == AUTH_SAS;
+  printf("%s: %u exchanges, %lu ms recorded, %s login\n", filename, (unsigned)exchanges.size(), recordedMs,
+         sasAuth ? "SAS token" : "client certificate");
+
+  ReplayTransport transport(exchanges, speed);
+  transport.verbose = verboseConsole;
+  // getNetwork() waits for registration forever, stop a replay that never gets there
+  transport.limitMs = maxMs >= 0 ? maxMs + 60000 : recordedMs * 4 + 60000;
+  replayClock = &transport;
+  NB_R410M<ReplayTransport> driver(transport);
+  modem = &driver;
+
+  const replay_step_t *steps = resume ? RESUME_STEPS : SETUP_STEPS;
+  int count = resume ? sizeof(RESUME_STEPS) / sizeof(RESUME_STEPS[0]) : sizeof(SETUP_STEPS) / sizeof(SETUP_STEPS[0]);
+
+  printf("%-18s %10s %10s %6s\n", "step", "recorded", "replay", "result");
+  for (int i = 0; i < count; i++)
+  {
+    if (steps[i].auth != AUTH_ANY && steps[i].auth != auth)
+    {
+      continue;
+    }
+    transport.beginStep();
+    unsigned long start = millis();
+    int result = steps[i].run();
+    unsigned long elapsed = millis() - start;
+    long recorded = transport.stepRecordedMs();
+    char recordedText[24];
+    if (recorded < 0)
+    {
+      strcpy(recordedText, "-");
+    }
+    else
+    {
+      snprintf(recordedText, sizeof(recordedText), "%ld", recorded);
+    }
+    printf("%-18s %10s %10lu %6s\n", steps[i].name, recordedText, elapsed, result ? "fail" : "ok");
+  }
+
+  unsigned long total = millis();
+  const replay_stats_t &stats = transport.stats;
+  printf("total %lu ms, %lu commands, %lu timeouts\n", total, driver.metrics.commands, driver.metrics.timeouts);
+  printf("served %d, changed %d, repeated %d, skipped %d, unrecorded %d\n", stats.served, stats.changed,
+         stats.repeated, stats.skipped, stats.unrecorded);
+
+  int status = 0;
+  if (stats.unrecorded > 0)
+  {
+    printf("FAIL: the driver sent %d commands that are not in the transcript\n", stats.unrecorded);
+    status = 1;
+  }
+  if (maxMs >= 0 && total > (unsigned long)maxMs)
+  {
+    printf("FAIL: %lu ms is over the limit of %ld ms\n", total, maxMs);
+    status = 1;
+  }
+  return status;
+}
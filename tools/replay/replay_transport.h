@@ -0,0 +1,523 @@
+/**
+ * @file replay_transport.h
+ * @author Bergma
+ * @brief Transport that plays a recorded UART transcript back to the driver on a virtual clock
+ * @version 0.1
+ * @date 2022-12
+ *
+ * @details The transcript is split into exchanges: a command (or raw data such as a certificate) sent
+ * @details to the module and everything the module sent until the next command. When the driver sends a
+ * @details command, the next recorded exchange for the same command is looked up and its response bytes
+ * @details are queued at their recorded offsets. A command that is repeated, like the AT+CEREG? polling in
+ * @details getNetwork(), gets the latest recorded answer that is due at the current time, so the module
+ * @details state follows the recording even if the driver polls at a different rate.
+ * @details A concatenated command line (AT+A;+B, see NB_R410M::beginBatch()) is answered from a recorded
+ * @details line with the same commands if there is one. Otherwise, e.g. for transcripts recorded before
+ * @details batching, every command in it is answered from its own recorded exchange and the responses
+ * @details are joined under one final result code, as the module does.
+ * @details Time only advances when the driver waits, so a replay is deterministic. The clock is either
+ * @details free running (as fast as possible) or paced against the wall clock at a given speed.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef REPLAY_TRANSPORT_H
+#define REPLAY_TRANSPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NB_transcript.h"
+
+#define REPLAY_DATA "<data>" // Key of exchanges that send raw data instead of a command
+
+/**
+ * @brief A command or data block sent to the module and the bytes that came back
+ */
+typedef struct
+{
+  std::string text;        // Command without the terminating \r, or the raw data
+  unsigned long txMs;      // Time the command was sent, relative to the transcript base time
+  unsigned long lastRxMs;  // Time of the last response byte, txMs if there was none
+  std::vector<std::pair<unsigned long, std::string> > rx; // Response chunks and their offset from txMs
+} replay_exchange_t;
+
+/**
+ * @brief Reads a transcript written by TranscriptTransport
+ * @param filename Transcript file
+ * @param exchanges The exchanges in recorded order
+ * @return 0 if successful, 1 if the file can not be read, 2 if it is not a valid transcript
+ */
+int loadTranscript(const char *filename, std::vector<replay_exchange_t> &exchanges)
+{
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL)
+  {
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  uint8_t chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+  if (data.size() < 9 || memcmp(&data[0], TRANSCRIPT_MAGIC, 4) != 0 || data[4] != TRANSCRIPT_VERSION)
+  {
+    return 2;
+  }
+
+  exchanges.clear();
+  unsigned long time = 0;
+  std::string pendingTx; // Bytes of the current run of transmit records
+  unsigned long pendingMs = 0;
+  size_t pos = 9;
+  while (pos < data.size())
+  {
+    uint8_t tag = data[pos++];
+    unsigned long delta = 0;
+    int shift = 0;
+    uint8_t b;
+    do
+    {
+      if (pos >= data.size() || shift > 28)
+      {
+        return 2;
+      }
+      b = data[pos++];
+      delta |= (unsigned long)(b & 0x7F) << shift;
+      shift += 7;
+    } while (b & 0x80);
+    size_t length = (tag & 0x7F) + 1;
+    if (pos + length > data.size())
+    {
+      return 2;
+    }
+    time += delta;
+    std::string bytes((const char *)&data[pos], length);
+    pos += length;
+
+    if (tag & TRANSCRIPT_TX)
+    {
+      pendingTx += bytes;
+      pendingMs = time;
+      continue;
+    }
+    if (!pendingTx.empty())
+    {
+      // A run of transmitted bytes is over. Commands are split on \r, anything else is raw data
+      replay_exchange_t exchange;
+      exchange.txMs = pendingMs;
+      exchange.lastRxMs = pendingMs;
+      if (pendingTx.compare(0, 2, "AT") == 0)
+      {
+        size_t start = 0;
+        size_t end;
+        while ((end = pendingTx.find('\r', start)) != std::string::npos)
+        {
+          exchange.text = pendingTx.substr(start, end - start);
+          exchanges.push_back(exchange);
+          start = end + 1;
+        }
+        if (start < pendingTx.size())
+        {
+          exchange.text = pendingTx.substr(start);
+          exchanges.push_back(exchange);
+        }
+      }
+      else
+      {
+        exchange.text = pendingTx;
+        exchanges.push_back(exchange);
+      }
+      pendingTx.clear();
+    }
+    if (exchanges.empty())
+    {
+      continue; // Output from the module before the first command, e.g. the boot message
+    }
+    replay_exchange_t &last = exchanges.back();
+    if (!last.rx.empty() && last.txMs + last.rx.back().first == time)
+    {
+      last.rx.back().second += bytes;
+    }
+    else
+    {
+      last.rx.push_back(std::make_pair(time - last.txMs, bytes));
+    }
+    last.lastRxMs = time;
+  }
+  if (!pendingTx.empty())
+  {
+    replay_exchange_t exchange;
+    exchange.text = pendingTx;
+    exchange.txMs = pendingMs;
+    exchange.lastRxMs = pendingMs;
+    exchanges.push_back(exchange);
+  }
+  return 0;
+}
+
+/**
+ * @brief Splits a concatenated command line at the semicolons outside quotes that start the next
+ * @brief extended command. The commands after the first are returned without "AT"
+ */
+std::vector<std::string> splitCommandLine(const std::string &text)
+{
+  std::vector<std::string> parts;
+  bool quoted = false;
+  size_t start = 0;
+  for (size_t i = 0; i < text.size(); i++)
+  {
+    if (text[i] == '"')
+    {
+      quoted = !quoted;
+    }
+    else if (text[i] == ';' && !quoted && i + 1 < text.size() && text[i + 1] == '+')
+    {
+      parts.push_back(text.substr(start, i - start));
+      start = i + 1;
+    }
+  }
+  parts.push_back(text.substr(start));
+  return parts;
+}
+
+/**
+ * @brief Key of one command, its name and first parameter, e.g. AT+UMQTT=2 or AT+CEREG?. The security
+ * @brief profile commands also keep the operation, AT+USECPRF=2,4 and AT+USECPRF=2,13 are different steps
+ */
+std::string commandKey(const std::string &command)
+{
+  size_t end = command.find(',');
+  if (end != std::string::npos && command.find("+USECPRF=") != std::string::npos)
+  {
+    end = command.find(',', end + 1);
+  }
+  return command.substr(0, end);
+}
+
+/**
+ * @brief Commands are matched on their key, see commandKey(). A concatenated line is matched on the
+ * @brief keys of all its commands
+ */
+std::string replayKey(const std::string &text, bool data)
+{
+  if (data || text.compare(0, 2, "AT") != 0)
+  {
+    return REPLAY_DATA;
+  }
+  std::vector<std::string> parts = splitCommandLine(text);
+  std::string key;
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    key += (i > 0 ? ";" : "") + commandKey(parts[i]);
+  }
+  return key;
+}
+
+/**
+ * @brief Counters of how well the driver followed the recording
+ */
+typedef struct
+{
+  int served;     // Commands answered from the transcript
+  int changed;    // Of those, commands whose parameters differ from the recording
+  int repeated;   // Repeated commands answered with an earlier response
+  int skipped;    // Recorded exchanges the driver never asked for
+  int unrecorded; // Commands with no recorded exchange, left unanswered
+} replay_stats_t;
+
+class ReplayTransport
+{
+public:
+  replay_stats_t stats;
+  int verbose;
+  unsigned long limitMs; // The replay is aborted when the virtual clock passes this, 0 for no limit
+
+  /**
+   * @param recorded Exchanges from loadTranscript()
+   * @param speed 0 to run as fast as possible, otherwise virtual ms per wall clock ms
+   */
+  ReplayTransport(const std::vector<replay_exchange_t> &recorded, double speed)
+      : verbose(0), limitMs(0), exchanges(recorded), pace(speed), now(0), cursor(0), lastServed(-1), stepFirst(-1),
+        runRecordedMs(0), runReplayMs(0)
+  {
+    memset(&stats, 0, sizeof(stats));
+    wallStart = std::chrono::steady_clock::now();
+  }
+
+  /**
+   * @brief Virtual time in ms since the start of the replay
+   */
+  unsigned long millis() const { return now; }
+
+  /**
+   * @brief Advances the virtual clock, and waits for the wall clock when pacing
+   */
+  void advance(unsigned long ms)
+  {
+    now += ms;
+    if (limitMs > 0 && now > limitMs)
+    {
+      printf("FAIL: replay aborted after %lu ms\n", now);
+      exit(1);
+    }
+    if (pace > 0)
+    {
+      std::this_thread::sleep_until(wallStart + std::chrono::microseconds((long long)(now * 1000.0 / pace)));
+    }
+  }
+
+  /**
+   * @brief Starts timing a step of the driver sequence
+   */
+  void beginStep() { stepFirst = -1; }
+
+  /**
+   * @brief How long the exchanges answered since beginStep() took in the recording
+   * @return Recorded time in ms, -1 if nothing was answered from the transcript
+   */
+  long stepRecordedMs() const
+  {
+    if (stepFirst < 0)
+    {
+      return -1;
+    }
+    return (long)(exchanges[lastServed].lastRxMs - exchanges[stepFirst].txMs);
+  }
+
+  // Transport interface used by NB_R410M
+
+  void begin(unsigned long) {}
+
+  int available()
+  {
+    if (!rx.empty() && rx.front().readyMs <= now)
+    {
+      return 1;
+    }
+    // The driver is waiting for the module, this is where time passes
+    advance(1);
+    return !rx.empty() && rx.front().readyMs <= now;
+  }
+
+  int read()
+  {
+    if (rx.empty() || rx.front().readyMs > now)
+    {
+      return -1;
+    }
+    chunk_t &chunk = rx.front();
+    int c = (unsigned char)chunk.data[chunk.pos++];
+    if (chunk.pos >= chunk.data.size())
+    {
+      rx.pop_front();
+    }
+    return c;
+  }
+
+  size_t print(const char *text)
+  {
+    for (const char *p = text; *p; p++)
+    {
+      if (*p == '\r')
+      {
+        serve(line, false);
+        line.clear();
+      }
+      else if (*p != '\n')
+      {
+        line += *p;
+      }
+    }
+    return strlen(text);
+  }
+
+  size_t write(const uint8_t *data, size_t size)
+  {
+    serve(std::string((const char *)data, size), true);
+    return size;
+  }
+
+private:
+  typedef struct
+  {
+    std::string data;
+    size_t pos;
+    unsigned long readyMs;
+  } chunk_t;
+
+  const std::vector<replay_exchange_t> &exchanges;
+  double pace;
+  std::chrono::steady_clock::time_point wallStart;
+  unsigned long now;
+  std::deque<chunk_t> rx;
+  std::string line;
+  size_t cursor;          // First exchange that has not been used
+  long lastServed;        // Exchange the last command was answered from
+  long stepFirst;         // First exchange answered in the current step
+  unsigned long runRecordedMs; // Recorded and replay time of the first command of a repeated run
+  unsigned long runReplayMs;
+
+  void queueChunk(const std::string &data, unsigned long readyMs)
+  {
+    chunk_t chunk;
+    chunk.data = data;
+    chunk.pos = 0;
+    chunk.readyMs = readyMs;
+    rx.push_back(chunk);
+  }
+
+  void queueResponse(size_t index)
+  {
+    const replay_exchange_t &exchange = exchanges[index];
+    for (size_t i = 0; i < exchange.rx.size(); i++)
+    {
+      queueChunk(exchange.rx[i].second, now + exchange.rx[i].first);
+    }
+  }
+
+  /**
+   * @brief Finds the next recorded exchange for a command and marks it used
+   * @return Index of the exchange, -1 if there is none
+   */
+  long findExchange(const std::string &text, const std::string &key, bool data)
+  {
+    for (size_t j = cursor; j < exchanges.size(); j++)
+    {
+      if (replayKey(exchanges[j].text, false) != key)
+      {
+        continue;
+      }
+      stats.served++;
+      stats.skipped += j - cursor;
+      if (exchanges[j].text != text)
+      {
+        stats.changed++;
+        if (verbose && !data)
+        {
+          printf("[replay] %s differs from recorded %s\n", text.c_str(), exchanges[j].text.c_str());
+        }
+      }
+      if (stepFirst < 0)
+      {
+        stepFirst = j;
+      }
+      lastServed = j;
+      cursor = j + 1;
+      runRecordedMs = exchanges[j].txMs;
+      runReplayMs = now;
+      return j;
+    }
+    return -1;
+  }
+
+  /**
+   * @brief Answers a concatenated command line from the exchanges of its commands, recorded one by one.
+   * @brief The information responses are joined, the module stops at the first command that fails
+   */
+  void serveBatch(const std::vector<std::string> &parts)
+  {
+    std::string info;
+    unsigned long offset = 0;
+    bool failed = false;
+    for (size_t i = 0; i < parts.size() && !failed; i++)
+    {
+      std::string command = i == 0 ? parts[i] : "AT" + parts[i];
+      long j = findExchange(command, replayKey(command, false), false);
+      if (j < 0)
+      {
+        stats.unrecorded++;
+        if (verbose)
+        {
+          printf("[replay] %s is not in the transcript, batch ends with ERROR\n", command.c_str());
+        }
+        failed = true;
+        break;
+      }
+      std::string response;
+      for (size_t k = 0; k < exchanges[j].rx.size(); k++)
+      {
+        response += exchanges[j].rx[k].second;
+      }
+      offset += exchanges[j].lastRxMs - exchanges[j].txMs;
+      size_t ok = response.rfind("OK");
+      if (ok == std::string::npos || response.find("ERROR") != std::string::npos)
+      {
+        failed = true;
+        break;
+      }
+      info += response.substr(0, ok);
+    }
+    queueChunk(info + (failed ? "\r\nERROR\r\n" : "\r\nOK\r\n"), now + offset);
+  }
+
+  void serve(const std::string &text, bool data)
+  {
+    std::string key = replayKey(text, data);
+
+    // The same command again: answer with the latest recorded response that is due by now
+    if (lastServed >= 0 && !data && exchanges[lastServed].text == text)
+    {
+      size_t due = lastServed;
+      for (size_t j = lastServed + 1; j < exchanges.size() && exchanges[j].text == text; j++)
+      {
+        if (exchanges[j].txMs - runRecordedMs <= now - runReplayMs)
+        {
+          due = j;
+        }
+      }
+      if (due == (size_t)lastServed)
+      {
+        stats.repeated++;
+      }
+      else
+      {
+        stats.served++;
+        lastServed = due;
+        cursor = due + 1;
+      }
+      if (stepFirst < 0)
+      {
+        stepFirst = due;
+      }
+      queueResponse(due);
+      return;
+    }
+
+    long j = findExchange(text, key, data);
+    if (j >= 0)
+    {
+      queueResponse(j);
+      return;
+    }
+    if (!data)
+    {
+      std::vector<std::string> parts = splitCommandLine(text);
+      if (parts.size() > 1)
+      {
+        serveBatch(parts);
+        return;
+      }
+    }
+
+    stats.unrecorded++;
+    if (verbose)
+    {
+      printf("[replay] %s is not in the transcript, no response\n", data ? REPLAY_DATA : text.c_str());
+    }
+  }
+};
+
+#endif // REPLAY_TRANSPORT_H